@@ -1,5 +1,20 @@
+(* resume of [a] costs three switches: resume, transfer and yield *)
+let ping_pong () =
+  let rec a = lazy (Fiber.create (fun () ->
+                        while true do Fiber.transfer (Lazy.force b) done) ())
+  and b = lazy (Fiber.create (fun () ->
+                    while true do Fiber.yield () done) ()) in
+  Lazy.force a
 
 let _ =
   let fiber = Fiber.create (fun _ -> while true do Fiber.yield () done) () in
-  Benchmark.throughput1 ~repeat:10 ~name:"resume" 3 Fiber.resume fiber
-  |> Benchmark.tabulate
+  let wake f = Fiber.wake f; Fiber.cancel_wake f in
+  let tests = [("resume", Fiber.resume, fiber);
+               ("transfer", Fiber.resume, ping_pong ());
+               ("wake", wake, fiber)] in
+  Printexc.record_backtrace false;
+  let res = Benchmark.throughputN ~repeat:10 3 tests in
+  Printexc.record_backtrace true;
+  let bt = Benchmark.throughputN ~repeat:10 3
+             [("resume+backtrace", Fiber.resume, fiber)] in
+  Benchmark.tabulate (res @ bt)
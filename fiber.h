@@ -40,7 +40,11 @@ struct coro {
 	struct coro_context ctx;
 	void *stack, *mmap;
 	size_t stack_size, mmap_size;
+	void *guard;		/* NULL if stack has no guard zone */
+	size_t guard_size;
+	uintptr_t *canary;	/* bottom of unguarded stack */
 	void *w;
+	int revents;		/* set with w by io watchers */
 };
 
 
@@ -48,11 +52,21 @@ struct fiber {
 	struct coro coro;
 	struct fiber *caller;
 	long long id;
+	unsigned slot, gen; /* id is gen << 32 | slot, see fiber_create() */
+	int stack_class; /* stack is 1 << stack_class pages */
+	int stack_guard;
+	char *zombie_sp; /* stack below is unused while fiber is a zombie */
+	char trimmed;
+	uintptr_t *poison_lo; /* stack below is poisoned, see stack_profile */
+	char poisoned;
 
-	SLIST_ENTRY(fiber) link, zombie_link;
-	TAILQ_ENTRY(fiber) wake_link;
+	LIST_ENTRY(fiber) link;
+	SLIST_ENTRY(fiber) zombie_link, dirty_link;
+	TAILQ_ENTRY(fiber) wake_link, untrimmed_link;
 	void *wake;
+	int priority;
 	char cancel;
+	char dirty; /* ran since last minor GC, see fiber_mark_dirty() */
 
 	char * top_of_stack;
 	char * bottom_of_stack;
@@ -68,12 +82,23 @@ struct fiber {
 	intptr_t cb, arg;
 };
 
-extern struct fiber *fiber, *sched;
-extern struct coro_context *sched_ctx;
+/* scheduler state is per thread, see fiber_thread_init() */
+extern __thread struct fiber *fiber, *sched;
+extern __thread struct coro_context *sched_ctx;
+/* killed by stack overflow handler, buried by whoever it returned to */
+extern __thread struct fiber *fiber_killed;
+void fiber_bury(void);
+
+struct fiber *fid2fiber(long long fid);
+int fiber_wake(struct fiber *f, void *arg);
+/* Safe to call from any thread: wakes fiber [fid] in the next loop
+   iteration. Returns -1 if out of memory. */
+int fiber_wake_remote(long long fid);
 
 #ifdef FIBER_TRACE
 void fiber_resume(struct fiber *callee, void *w);
 void *fiber_yield(void);
+void *fiber_transfer(struct fiber *target, void *w);
 #define resume(callee, w) ({					\
 	fprintf(stderr, "resume: %lli/%s -> %lli/%s arg:%p\n",	\
 		  fiber->id, fiber->name, callee->id, callee->name, w); \
@@ -87,9 +112,17 @@ void *fiber_yield(void);
 	fprintf(stderr, "yield: return arg:%p\n", yield_ret);	\
 	yield_ret;						\
 	})
+#define transfer(target, w) ({					\
+	fprintf(stderr, "transfer: %lli/%s -> %lli/%s arg:%p\n",	\
+		  fiber->id, fiber->name, target->id, target->name, w); \
+	void *transfer_ret = fiber_transfer(target, w);		\
+	fprintf(stderr, "transfer: return arg:%p\n", transfer_ret); \
+	transfer_ret;						\
+	})
 #else
 void resume(struct fiber *callee, void *w);
 void *yield(void);
+void *transfer(struct fiber *target, void *w);
 #endif
 
 #endif
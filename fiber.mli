@@ -61,7 +61,11 @@ let _ =
 type 'a fiber
 (** a fiber type. *)
 
-val create : ('a -> 'b) -> 'a -> 'b fiber
+type priority = High | Normal | Low | Background
+(** Scheduling priority, see {!set_priority}. *)
+
+val create : ?stack_size:int -> ?guard:bool -> ?name:string ->
+             ?priority:priority -> ('a -> 'b) -> 'a -> 'b fiber
 (** [create f arg] creates a fiber.
 
    A fiber can be in one of the following states: [sleeping],
@@ -70,15 +74,39 @@ val create : ('a -> 'b) -> 'a -> 'b fiber
    [f] returns the fiber enters state [dead].  return value of [f] can
    be obtained by calling {!join}.
 
-   Current implementation allocates 112 pages of stack and 16 pages of
-   guard zone. Graceful stack overflow detection is not (yet)
-   implemented and stack overflow will result in segmentation
-   violation.
+   [stack_size] is the size of the fiber stack in bytes. It is rounded
+   up to a power of 2 number of pages, but not less than 4 pages.
+   Default is 128 pages. Raises [Invalid_argument "Fiber.create"] if
+   [stack_size] is negative or too large and [Failure "Fiber.create"]
+   if the stack can not be allocated.
+
+   If [guard] is [true] (the default), 16 pages of guard zone are
+   allocated below the stack. Stack overflow in OCaml code raises
+   [Stack_overflow] inside the fiber. Stack overflow in a C stub
+   can't be turned into an exception: the fiber is killed, a message
+   with its id is printed on stderr and control returns to the caller
+   of the fiber. Killed fiber is never finished, so {!join} on it will
+   never return. Overflow inside the runtime or libc aborts the
+   program, their state can't be recovered.
+
+   Every guard zone costs the process two memory mappings, and Linux
+   limits their number by [vm.max_map_count] (65530 by default). So
+   with default settings only about 32000 guarded fibers can exist at
+   once; a million fibers is possible only with [~guard:false]. Such
+   stacks are allocated back to back and cost no mappings. Overflow
+   of such a stack silently corrupts the neighbour stack; it is
+   detected by a canary word on the next switch and aborts the
+   program.
+
+   [name] (truncated to 19 bytes) groups fibers in {!stack_profile}.
+
+   [priority] defaults to [Normal], see {!set_priority}.
 
    Fiber context creation is a relatively expensive process and
-   therefore library caches unused contexts of dead fibers. The cache
-   size is unbound, be careful when creating a lot of short living
-   fibers.
+   therefore library caches unused contexts of dead fibers. Contexts
+   are cached separately for every stack size. The cache size is
+   unbound, but stack memory of cached contexts is returned to the
+   OS, see {!set_zombie_limits}.
 
    Exception behavior is similar to the vanilla OCaml. You can [raise]
    exception inside a fiber and catch it with a [try ... with ...].
@@ -94,35 +122,138 @@ val resume : 'a fiber -> unit
    context to it. Trying to resume dead fiber will raise
    [Invalid_argument "Fiber.resume"]. *)
 
+val transfer : 'a fiber -> unit
+(** [transfer fb] switches from the current fiber directly to the
+   suspended fiber [fb]. The current fiber becomes suspended as if it
+   called {!yield}, and [fb] takes over its caller: when [fb] yields,
+   control goes to the fiber which resumed the current one. A
+   pipeline of fibers passing control with [transfer] costs one
+   context switch per hop instead of two for {!resume} and {!yield}
+   through a common caller. Raises [Invalid_argument "Fiber.transfer"]
+   if called from initial context or if [fb] is dead, running or
+   the current fiber. *)
+
+(** {2 Memory} *)
+
+val set_zombie_limits : ?count:int -> ?bytes:int -> unit -> unit
+(** [set_zombie_limits ~count ~bytes ()] limits number of cached dead
+   fiber contexts which keep their stack memory, and total size of
+   their stacks. When a limit is exceeded, stack of the oldest cached
+   context is released with [madvise(MADV_DONTNEED)]; the context
+   itself stays in the cache and can be reused. Omitted limit means
+   no limit. Defaults are 1024 contexts and 64M. *)
+
+val trim : unit -> unit
+(** [trim ()] releases stacks of all cached dead fiber contexts. *)
+
+type zombie_stats = { zombies : int;
+                      (** number of cached dead fiber contexts *)
+                      trimmed : int;
+                      (** number of cached contexts with released stack *)
+                      untrimmed_bytes : int;
+                      (** total stack size of contexts which are not trimmed *)
+                      reclaimed_bytes : int;
+                      (** memory returned to the OS so far *) }
+
+val zombie_stats : unit -> zombie_stats
+
+val set_stack_profiling : bool -> unit
+(** [set_stack_profiling true] clears collected profile and starts
+   measuring stack usage of fibers. Stack of every fiber created
+   while profiling is on is filled with a pattern, and when the fiber
+   finishes the deepest overwritten word gives its stack high-water
+   mark. This makes {!create} slower, but after the first use only
+   the part of a cached stack which was actually touched is filled
+   again. Killed fibers and fibers which never finish are not
+   measured. Use it to pick [stack_size] for {!create}. *)
+
+type stack_profile = { name : string;
+                       (** fiber name, see {!create} *)
+                       samples : int;
+                       (** number of finished fibers *)
+                       max_depth : int;
+                       (** deepest stack usage in bytes *)
+                       histogram : int array;
+                       (** [histogram.(k)] is number of fibers which
+                          used more than [512 lsl k] and at most
+                          [1024 lsl k] bytes of stack (the first bucket
+                          counts everything up to 1K, the last one
+                          everything above) *) }
+
+val stack_profile : unit -> stack_profile list
+(** [stack_profile ()] returns stack usage collected since profiling
+   was enabled, one entry per fiber name. *)
+
+val stack_percentile : stack_profile -> float -> int
+(** [stack_percentile p q] returns stack size in bytes which was enough
+   for fraction [q] (e.g. [0.99]) of fibers in [p]. The result is an
+   upper bound rounded to a histogram bucket. *)
+
 (** {2 Event loop}
     Integration with {{: http://software.schmorp.de/pkg/libev.html} libev}
     event loop.
  *)
 
-val run : ('a -> 'b) -> 'a  -> 'b option
+val run : ?stack_size:int -> ?guard:bool -> ?name:string ->
+          ?priority:priority -> ('a -> 'b) -> 'a  -> 'b option
 (** [run f arg] starts the event loop and executes [f arg] inside a
    newly created fiber. Returns [None] if {!break} is called during
-   execution of [f]. *)
+   execution of [f]. See {!create} for other arguments. *)
 
 val break : unit -> unit
 (** [break] stops event loop and exits from {!run}. *)
 
+val set_run_budget : ?rounds:int -> ?time:float -> unit -> unit
+(** [set_run_budget ~rounds ~time ()] controls how long woken fibers
+   are run before the event loop polls for I/O. Fibers are resumed in
+   rounds, every round runs all fibers woken before it started, so
+   fibers waking each other are dispatched back to back without a
+   syscall. Polling happens when no fiber is ready, after [rounds]
+   rounds or when [time] seconds have passed since the first round.
+   Omitted limit means no limit. Default is 10 rounds without a time
+   limit; for CPU-bound fan-out use e.g. [~time:0.001] alone. Raises
+   [Invalid_argument "Fiber.set_run_budget"] if [rounds] is less than 1
+   or [time] is negative. *)
+
 val wake : 'a fiber -> unit
 (** [wake fb] register a wakeup for a fiber [fb]. A fiber [fb] will be resumed
    in the next iteration of the event loop. *)
 
+val wake_remote : 'a fiber -> unit
+(** [wake_remote fb] is {!wake} which can be called from any systhread.
+   Wakeups requested between two iterations of the event loop are
+   delivered together with a single signal to the loop. A fiber which
+   is dead by then is not woken. C code can use [fiber_wake_remote()]
+   from [fiber.h] without holding the runtime lock. *)
+
 val cancel_wake : 'a fiber -> unit
 (** [cancel_wake fb] cancels pending wakeup for [fb]. *)
 
+val set_priority : 'a fiber -> priority -> unit
+(** [set_priority fb p] changes priority of [fb], a pending wakeup is
+   moved accordingly. Woken fibers with higher priority are resumed
+   first. To avoid starvation a ready fiber is resumed anyway after
+   fibers of higher priorities were resumed 8 ([Normal]), 32 ([Low])
+   or 128 ([Background]) times in a row while it was waiting. Raises
+   [Invalid_argument "Fiber.set_priority"] if [fb] is dead. *)
+
 val join : 'a fiber -> 'a
 (** [join fb] suspends the current fiber until [fb] is dead and returns
    the return value of it. It is permitted to call [join fb] several times. *)
 
-type event = READ | WRITE
-val wait_io_ready : Unix.file_descr -> event -> unit
+type event = READ | WRITE | READ_WRITE
+(** [READ_WRITE] waits for either direction. *)
+
+exception Timeout
+
+val wait_io_ready : ?timeout:float -> Unix.file_descr -> event -> unit
 (** [wait_io_ready fd ev] suspends the current fiber until reading or
    writing from file descriptor [fd] can be performed without
-   blocking.
+   blocking. Raises {!Timeout} if [timeout] seconds pass first; a
+   deadline already in the past (negative [timeout]) expires at the
+   next loop iteration. A {!wake} ends the wait early and returns
+   normally, so the caller should retry the operation or check why it
+   was woken; it never raises {!Timeout}.
 
    Please note, that the library itself doesn't put file descriptor
    into a nonblocking mode. Therefore, it's advisable to either put
@@ -130,21 +261,182 @@ val wait_io_ready : Unix.file_descr -> event -> unit
    [write(2)]or use [send(2)]and [recv(2)] with corresponding
    [flags]. *)
 
-val sleep : float -> unit
-(** [sleep s] suspends the current fiber for [s] seconds. *)
+val wait_io : ?timeout:float -> Unix.file_descr -> event -> event
+(** [wait_io fd ev] is {!wait_io_ready} which returns the ready event.
+   Waiting with [READ_WRITE] lets a single fiber serve both directions
+   of a connection: the result tells whether [fd] is ready for
+   [READ], [WRITE] or both. When woken by {!wake} it returns [ev]. *)
+
+val wait_any : ?timeout:float -> (Unix.file_descr * event) list ->
+               (Unix.file_descr * event) option
+(** [wait_any l] suspends the current fiber until one of the events in
+   [l] is ready and returns the descriptor with its ready event (see
+   {!wait_io}), or returns [None] if [timeout] seconds pass first or
+   the fiber is woken by {!wake}. No extra fiber is needed for the
+   timeout: a timer and the I/O watchers all resume the waiting
+   fiber. *)
+
+val sleep : ?slack:float -> float -> unit
+(** [sleep s] suspends the current fiber for [s] seconds. The fiber may
+   sleep up to [slack] seconds longer (default is set by
+   {!set_timer_slack}): the deadline is rounded up to a multiple of
+   [slack], so fibers whose deadlines fall in the same window are
+   woken in one loop iteration. *)
+
+external now : unit -> (float [@unboxed]) =
+  "stub_now_byte" "stub_now" [@@noalloc]
+(** [now ()] returns time of the current event loop iteration on the
+   monotonic clock, in seconds from an arbitrary point. It is cached by
+   the loop, so it costs neither a system call nor an allocation (it
+   is declared as an external to be called directly from other
+   modules), but doesn't advance while a fiber runs without
+   yielding. *)
+
+val sleep_until : ?slack:float -> float -> unit
+(** [sleep_until t] suspends the current fiber until {!now} reaches
+   [t]. Unlike {!sleep} in a loop, [sleep_until (start +. n *. period)]
+   doesn't drift. See {!sleep} for [slack]. *)
+
+val set_timer_slack : float -> unit
+(** [set_timer_slack s] sets default slack for {!sleep} and for
+   [timeout] arguments. Default is [0.], no slack. Raises
+   [Invalid_argument "Fiber.set_timer_slack"] if [s] is negative. *)
+
+val set_timer_resolution : float -> unit
+(** [set_timer_resolution r] switches timers of {!sleep} and of
+   [timeout] arguments to a timing wheel with [r] seconds per tick.
+   Starting and stopping a wheel timer is O(1), unlike libev's timer
+   heap, which pays off with many timeouts that are constantly reset,
+   e.g. idle timeouts of 100k connections. Expiration is rounded up to
+   a tick. [0.] (the default) returns to precise libev timers. Raises
+   [Invalid_argument "Fiber.set_timer_resolution"] if [r] is negative
+   or wheel timers are pending. *)
+
+(** Registered file descriptors.
+
+   {!wait_io_ready} starts and stops a libev watcher on every call,
+   which costs an [epoll_ctl(2)] per wait. A registered descriptor
+   keeps its watcher for its lifetime, so a loop which reads until
+   [EAGAIN] and then waits costs only the [epoll_wait(2)]. *)
+module Fd : sig
+  type t
+
+  val register : Unix.file_descr -> t
+  (** [register fd] puts [fd] into non-blocking mode and creates a
+     watcher for it. The watcher is released by {!unregister} or when
+     [t] is garbage collected. The descriptor itself is never closed by
+     the library. *)
+
+  val unregister : t -> unit
+  (** [unregister t] releases the watcher. Fibers waiting on [t] are
+     woken. Call it before closing the descriptor. *)
+
+  val descr : t -> Unix.file_descr
+  (** [descr t] returns the registered descriptor. *)
+
+  val wait : t -> event -> unit
+  (** [wait t ev] suspends the current fiber until [ev] can be
+     performed on [t] without blocking, see {!wait_io_ready}. At most
+     one fiber can wait for each event on a descriptor. Raises
+     [Invalid_argument "Fiber.Fd.wait"] if there is already a waiter,
+     if [t] is unregistered or if called from initial context. *)
+
+  val wait_io : t -> event -> event
+  (** [wait_io t ev] is {!wait} which returns the ready event, see
+     {!Fiber.wait_io}. *)
+
+  (** Functions below behave like their counterparts in [Unix], but
+     try the system call first and suspend the current fiber only if it
+     would block. There is no loop iteration when data is already
+     available. In initial context they don't wait and raise
+     [Unix_error (EAGAIN, _, _)] instead. *)
+
+  val read : t -> bytes -> int -> int -> int
+
+  val write : t -> bytes -> int -> int -> int
+  (** [write t buf ofs len] writes all [len] bytes, waiting as
+     necessary. *)
+
+  val recv : t -> bytes -> int -> int -> Unix.msg_flag list -> int
+
+  val send : t -> bytes -> int -> int -> Unix.msg_flag list -> int
+  (** [send] never raises [SIGPIPE], [EPIPE] is reported instead. *)
+
+  val accept : t -> Unix.file_descr * Unix.sockaddr
+  (** [accept t] returns a connection already in non-blocking mode. *)
+
+  val use_uring : ?entries:int -> unit -> bool
+  (** [use_uring ?entries ()] switches functions above to io_uring
+     for sockets: when a call would block, the operation is submitted
+     to the kernel with a queue of [entries] (default 256) instead of
+     waiting for readiness and retrying. Other descriptors keep the
+     readiness path. Submissions of one loop iteration are flushed
+     with a single system call, when the queue is full and the kernel
+     doesn't accept more the call falls back to readiness. Returns
+     [false] and keeps the readiness path if io_uring is not
+     available. The setting applies to the calling thread and cannot
+     be reverted. An operation pending on [t] when it is unregistered
+     fails with [Unix_error (ECANCELED, _, _)]. *)
+end
+
+(** {2 Threads}
+
+   Every systhread using fibers has its own scheduler, created on the
+   first call into the library from the thread. Event loop, ready
+   queue, zombie cache and settings ({!set_run_budget},
+   {!set_zombie_limits}, {!set_timer_resolution}, {!set_timer_slack},
+   {!set_stack_profiling}, {!Fd.use_uring}) are per thread. A fiber
+   or an {!Fd.t} belongs to the thread which created it, functions
+   above raise [Invalid_argument] when given one from another thread;
+   use {!wake_remote} to wake a fiber across threads. {!Blocking} pool
+   is shared.
+
+   Fibers switch without releasing the runtime lock, it is released
+   when the thread blocks: in a blocking section or when its loop
+   polls. [Thread] must be initialized before the first fiber is
+   created, which is the case when it is linked in.
+
+   When a thread exits, its scheduler is reused by the next thread
+   which starts using fibers, along with {!Fd.t} values still
+   registered in it; ids of its fibers stay invalid. At most 256
+   threads can run fibers at the same time. A thread which exits
+   while some of its fibers are suspended keeps its scheduler, so its
+   slot is lost for the process lifetime. *)
+
+(** {2 OCaml 5}
+
+   OCaml 5 has none of the runtime hooks the native stacks rely on,
+   there a fiber is built on an effect handler and the event loop
+   polls with poll(2) instead of libev. The API and the rules
+   above are the same: every systhread, and so every domain, runs its
+   own scheduler, and a process can serve connections with one
+   {!run} per domain. {!Mutex}, {!Condition} and {!MVar} synchronise
+   fibers of one scheduler only, use {!wake_remote} across domains.
+
+   Differences: [stack_size] and [guard] of {!create} are ignored,
+   there are no zombies and no stack profile, {!set_timer_resolution}
+   only rounds expiration up to a tick, {!Fd.use_uring} returns
+   [false] and an uncaught exception in a fiber is raised from
+   {!resume} of its caller. *)
 
 (**/**)
 
 (** {2 Unsafe}
 
-   Value passing variants of {!yield} and {!resume}. Please note, that
-   it's possible to circumvent type checker by using these
-   functions. It's a user’s responsibility to ensure that the type of
+   Value passing variants of {!yield}, {!resume} and {!transfer}.
+   Please note, that it's possible to circumvent type checker by using
+   these functions. It's a user’s responsibility to ensure that the type of
    value on both sides of the calls match. *)
 
 val unsafe_yield : unit -> 'a
 (** [unsafe_yield] yeilds back to a caller. See {!yield}. *)
 
+val unsafe_transfer : 'a fiber -> 'b -> 'c
+(** [unsafe_transfer fb v] transfers control to [fb] like {!transfer},
+   passing [v] to it. [fb] gets [v] as the result of its suspending
+   call ({!unsafe_yield} or [unsafe_transfer]). Returns the value
+   passed to the current fiber when it is resumed again. *)
+
 val unsafe_resume : 'a fiber -> 'b -> unit
 (** [unsafe_resume fb value] resumes [fb] and passes [value] to
    it. This [value] will be returned inside [fb] as result of
@@ -152,6 +444,37 @@ val unsafe_resume : 'a fiber -> 'b -> unit
 
 (**/**)
 
+(** Blocking system calls.
+
+   Calls which may block the whole process, e.g. disk I/O or name
+   resolution, are executed by a pool of threads while the calling
+   fiber is suspended and other fibers keep running. The functions
+   behave like their counterparts in [Unix]. Called from initial
+   context, they block as [Unix] functions do. *)
+module Blocking : sig
+  val set_threads : int -> unit
+  (** [set_threads n] limits the pool to [n] threads, default is 4.
+     Threads are started on demand. On OCaml 4 a thread idle for 10
+     seconds exits, and lowering the limit stops surplus idle
+     threads. *)
+
+  val openfile : string -> Unix.open_flag list -> Unix.file_perm ->
+                 Unix.file_descr
+
+  val read : Unix.file_descr -> bytes -> int -> int -> int
+
+  val write : Unix.file_descr -> bytes -> int -> int -> int
+  (** [write] performs a single [write(2)] and returns number of
+     bytes written, like [Unix.single_write]. *)
+
+  val fsync : Unix.file_descr -> unit
+
+  val stat : string -> Unix.stats
+
+  val getaddrinfo : string -> string -> Unix.getaddrinfo_option list ->
+                    Unix.addr_info list
+end
+
 (** {2 Synchronisation} *)
 
 module Mutex : sig
@@ -0,0 +1,275 @@
+(*
+ * Copyright (C) 2018 Yuriy Vostrikov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *)
+
+type id = int
+type fqueue = id Queue.t
+
+type 'a fiber = { mutable id: id;
+                  mutable result: 'a option;
+                  joinq: fqueue;
+                }
+
+external self_id : unit -> int = "stub_fiber_id" [@@noalloc]
+
+type priority = High | Normal | Low | Background
+
+external stub_create : ('a -> unit) -> 'a -> int -> bool -> string -> priority -> int =
+  "stub_fiber_create_byte" "stub_fiber_create"
+external set_priority_id : int -> priority -> unit = "stub_set_priority"
+external break : unit -> unit = "stub_break"
+external stub_set_run_budget : int -> float -> unit = "stub_set_run_budget"
+
+let set_run_budget ?(rounds=max_int) ?(time=0.) () =
+  stub_set_run_budget rounds time
+
+external wake_id : int -> unit = "stub_wake"
+external wake_remote_id : int -> unit = "stub_wake_remote"
+external cancel_wake_id : int -> unit = "stub_cancel_wake"
+
+external yield : unit -> unit = "stub_yield"
+external resume : 'a fiber -> unit = "stub_resume"
+
+external unsafe_yield : unit -> 'a = "stub_unsafe_yield"
+external unsafe_resume : 'a fiber -> 'b -> unit = "stub_unsafe_resume"
+
+external transfer : 'a fiber -> unit = "stub_transfer"
+external unsafe_transfer : 'a fiber -> 'b -> 'c = "stub_unsafe_transfer"
+
+external stub_sleep : (float [@unboxed]) -> (float [@unboxed]) -> unit =
+  "stub_fiber_sleep_byte" "stub_fiber_sleep"
+external set_timer_slack : float -> unit = "stub_set_timer_slack"
+external now : unit -> (float [@unboxed]) = "stub_now_byte" "stub_now" [@@noalloc]
+
+let sleep ?(slack = -1.) s =
+  stub_sleep s slack
+
+let sleep_until ?(slack = -1.) t =
+  stub_sleep (t -. now ()) slack
+external set_timer_resolution : float -> unit = "stub_set_timer_resolution"
+
+type zombie_stats = { zombies : int;
+                      trimmed : int;
+                      untrimmed_bytes : int;
+                      reclaimed_bytes : int; }
+
+external trim : unit -> unit = "stub_trim"
+external zombie_stats : unit -> zombie_stats = "stub_zombie_stats"
+external stub_set_zombie_limits : int -> int -> unit = "stub_set_zombie_limits"
+
+let set_zombie_limits ?(count=max_int) ?(bytes=max_int) () =
+  stub_set_zombie_limits count bytes
+
+type stack_profile = { name : string;
+                       samples : int;
+                       max_depth : int;
+                       histogram : int array; }
+
+external set_stack_profiling : bool -> unit = "stub_set_stack_profiling"
+external stack_profile : unit -> stack_profile list = "stub_stack_profile"
+
+let stack_percentile p q =
+  if p.samples = 0 then 0 else
+  let n = ceil (q *. float p.samples) in
+  let rec loop k acc =
+    let acc = acc + p.histogram.(k) in
+    if float acc >= n || k = Array.length p.histogram - 1
+    then min (1024 lsl k) p.max_depth
+    else loop (k + 1) acc
+  in
+  loop 0 0
+
+module FQueue = struct
+  include Queue
+  let yield q =
+    Queue.push (self_id ()) q;
+    yield ()
+
+  let wake q =
+    Queue.iter wake_id q;
+    Queue.clear q
+
+  let wake_one q =
+    try wake_id (Queue.pop q)
+    with Queue.Empty -> ()
+end
+
+let wake f =
+  wake_id f.id
+
+let wake_remote f =
+  wake_remote_id f.id
+
+let cancel_wake f =
+  cancel_wake_id f.id
+
+let set_priority f p =
+  set_priority_id f.id p
+
+let create ?(stack_size=0) ?(guard=true) ?(name="") ?(priority=Normal) f v =
+  let fiber = { id = -1; result = None; joinq = FQueue.create (); } in
+  let wrap v =
+    fiber.result <- Some (f v);
+    FQueue.wake fiber.joinq
+  in
+  fiber.id <- stub_create wrap v stack_size guard name priority;
+  fiber
+
+let rec join f =
+  match f.result with
+    Some v -> v
+  | None ->
+     FQueue.yield f.joinq;
+     join f
+
+external stub_run : 'a fiber -> unit = "stub_fiber_run"
+
+let run ?stack_size ?guard ?name ?priority g a =
+  let f = create ?stack_size ?guard ?name ?priority (fun () ->
+              let v = g a in
+              break ();
+              v) () in
+  wake f;
+  stub_run f;
+  f.result
+
+type event = READ | WRITE | READ_WRITE
+exception Timeout
+
+external stub_wait_io : Unix.file_descr -> event -> float -> int =
+  "stub_wait_io"
+external stub_wait_any : (Unix.file_descr * event) array -> float ->
+                         (int * event) option = "stub_wait_any"
+
+(* NaN means no timeout *)
+let timeout_arg = function
+    None -> nan
+  | Some t -> if t < 0. then 0. else t
+
+let wait_io ?timeout fd ev =
+  match stub_wait_io fd ev (timeout_arg timeout) with
+    -2 -> ev (* woken *)
+  | -1 -> raise Timeout
+  | 0 -> READ
+  | 1 -> WRITE
+  | _ -> READ_WRITE
+
+let wait_io_ready ?timeout fd ev =
+  ignore (wait_io ?timeout fd ev)
+
+let wait_any ?timeout fds =
+  let fds = Array.of_list fds in
+  match stub_wait_any fds (timeout_arg timeout) with
+    None -> None
+  | Some (i, ev) -> Some (fst fds.(i), ev)
+
+module Fd = struct
+  type t
+  external register : Unix.file_descr -> t = "stub_fd_register"
+  external unregister : t -> unit = "stub_fd_unregister"
+  external descr : t -> Unix.file_descr = "stub_fd_descr" [@@noalloc]
+  external wait : t -> event -> unit = "stub_fd_wait"
+  external wait_io : t -> event -> event = "stub_fd_wait_io"
+
+  external stub_read : t -> bytes -> int -> int -> int = "stub_fd_read"
+  external stub_write : t -> bytes -> int -> int -> int = "stub_fd_write"
+  external stub_recv : t -> bytes -> int -> int -> Unix.msg_flag list -> int
+    = "stub_fd_recv"
+  external stub_send : t -> bytes -> int -> int -> Unix.msg_flag list -> int
+    = "stub_fd_send"
+  external accept : t -> Unix.file_descr * Unix.sockaddr = "stub_fd_accept"
+
+  let check name buf ofs len =
+    if ofs < 0 || len < 0 || ofs > Bytes.length buf - len
+    then invalid_arg name
+
+  let read t buf ofs len =
+    check "Fiber.Fd.read" buf ofs len;
+    stub_read t buf ofs len
+
+  let write t buf ofs len =
+    check "Fiber.Fd.write" buf ofs len;
+    stub_write t buf ofs len
+
+  let recv t buf ofs len flags =
+    check "Fiber.Fd.recv" buf ofs len;
+    stub_recv t buf ofs len flags
+
+  let send t buf ofs len flags =
+    check "Fiber.Fd.send" buf ofs len;
+    stub_send t buf ofs len flags
+
+  external stub_use_uring : int -> bool = "stub_fd_use_uring"
+  let use_uring ?(entries=256) () = stub_use_uring entries
+end
+
+module Blocking = struct
+  external set_threads : int -> unit = "stub_blocking_set_threads"
+  external openfile : string -> Unix.open_flag list -> Unix.file_perm ->
+                      Unix.file_descr = "stub_blocking_open"
+  external stub_read : Unix.file_descr -> bytes -> int -> int -> int =
+    "stub_blocking_read"
+  external stub_write : Unix.file_descr -> bytes -> int -> int -> int =
+    "stub_blocking_write"
+  external fsync : Unix.file_descr -> unit = "stub_blocking_fsync"
+  external stat : string -> Unix.stats = "stub_blocking_stat"
+  external stub_getaddrinfo : string -> string -> int -> int -> int -> int list ->
+                              Unix.addr_info list =
+    "stub_blocking_getaddrinfo_byte" "stub_blocking_getaddrinfo"
+
+  let read fd buf ofs len =
+    Fd.check "Fiber.Blocking.read" buf ofs len;
+    stub_read fd buf ofs len
+
+  let write fd buf ofs len =
+    Fd.check "Fiber.Blocking.write" buf ofs len;
+    stub_write fd buf ofs len
+
+  let getaddrinfo node service opts =
+    let open Unix in
+    let family = ref (-1) and socktype = ref (-1)
+    and protocol = ref 0 and flags = ref [] in
+    List.iter (function
+        AI_FAMILY PF_UNIX -> family := 0
+      | AI_FAMILY PF_INET -> family := 1
+      | AI_FAMILY PF_INET6 -> family := 2
+      | AI_SOCKTYPE SOCK_STREAM -> socktype := 0
+      | AI_SOCKTYPE SOCK_DGRAM -> socktype := 1
+      | AI_SOCKTYPE SOCK_RAW -> socktype := 2
+      | AI_SOCKTYPE SOCK_SEQPACKET -> socktype := 3
+      | AI_PROTOCOL p -> protocol := p
+      | AI_NUMERICHOST -> flags := 0 :: !flags
+      | AI_CANONNAME -> flags := 1 :: !flags
+      | AI_PASSIVE -> flags := 2 :: !flags) opts;
+    stub_getaddrinfo node service !family !socktype !protocol !flags
+    |> List.rev
+end
+
+include Fiber_sync.Make (struct
+    type nonrec fqueue = fqueue
+    include FQueue
+  end)
+
+let _ =
+  assert(Sys.int_size == 63)
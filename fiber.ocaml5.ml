@@ -0,0 +1,887 @@
+(*
+ * Copyright (C) 2018 Yuriy Vostrikov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *)
+
+(* OCaml 5 backend. The runtime has no hooks to scan native stacks,
+   so a fiber is an effect handler: a suspended fiber is its
+   continuation. Every systhread (and therefore every domain) has its
+   own scheduler with a ready queue, a timer heap and descriptors
+   polled by poll(2). *)
+
+open Effect
+open Effect.Deep
+
+type priority = High | Normal | Low | Background
+
+type event = READ | WRITE | READ_WRITE
+exception Timeout
+
+type state = Sleeping | Running | Dead
+
+type ctx = { sched : sched;
+             mutable state : state;
+             mutable start : (unit -> unit) option;
+             mutable cont : (Obj.t, action) continuation option;
+             mutable prio : int;
+             mutable pending : bool;
+             mutable seq : int; (* bumped when a pending wakeup is dropped *) }
+
+and action = Done | Run of ctx * Obj.t
+
+and timer = { at : float;
+              fire : unit -> unit;
+              wheel : bool;
+              mutable idx : int; (* position in the heap, -1 if stopped *) }
+
+and watch = { wid : int;
+              wfd : Unix.file_descr;
+              bits : int; (* 1 is READ, 2 is WRITE *)
+              notify : int -> unit; }
+
+(* watches of one descriptor, [slot] is its index in [pset] *)
+and polled = { pfd : Unix.file_descr;
+               mutable pwatches : watch list;
+               mutable slot : int; }
+
+and sched = { ready : (ctx * int) Queue.t array;
+              starve : int array;
+              mutable nready : int;
+              mutable current : ctx option;
+              mutable break : bool;
+              mutable rounds : int;
+              mutable time : float;
+              mutable slack : float;
+              mutable resolution : float;
+              mutable wheel_timers : int;
+              mutable timers : timer array;
+              mutable ntimers : int;
+              watches : (int, watch) Hashtbl.t;
+              mutable watch_seq : int;
+              polled : (Unix.file_descr, polled) Hashtbl.t;
+              mutable pset : polled array;
+              mutable npolled : int;
+              (* arguments of poll(2), remote_rd goes first *)
+              mutable pfds : Unix.file_descr array;
+              mutable pevents : int array;
+              remote_lock : Stdlib.Mutex.t;
+              mutable remote : ctx list;
+              remote_rd : Unix.file_descr;
+              remote_wr : Unix.file_descr; }
+
+type fqueue = ctx Queue.t
+
+type 'a fiber = { ctx: ctx;
+                  mutable result: 'a option;
+                  joinq: fqueue;
+                }
+
+type _ Effect.t += Suspend : Obj.t Effect.t
+                 | Switch : ctx * Obj.t -> Obj.t Effect.t
+
+external now : unit -> (float [@unboxed]) = "stub_now_byte" "stub_now" [@@noalloc]
+external update_now : unit -> unit = "stub_update_now" [@@noalloc]
+
+let no_timer = { at = 0.; fire = ignore; wheel = false; idx = -1 }
+let no_polled = { pfd = Unix.stdin; pwatches = []; slot = -1 }
+
+let new_sched () =
+  let rd, wr = Unix.pipe ~cloexec:true () in
+  Unix.set_nonblock rd;
+  Unix.set_nonblock wr;
+  { ready = Array.init 4 (fun _ -> Queue.create ());
+    starve = Array.make 4 0;
+    nready = 0;
+    current = None;
+    break = false;
+    rounds = 10;
+    time = 0.;
+    slack = 0.;
+    resolution = 0.;
+    wheel_timers = 0;
+    timers = Array.make 64 no_timer;
+    ntimers = 0;
+    watches = Hashtbl.create 16;
+    watch_seq = 0;
+    polled = Hashtbl.create 16;
+    pset = Array.make 16 no_polled;
+    npolled = 0;
+    pfds = Array.make 17 rd;
+    pevents = Array.make 17 0;
+    remote_lock = Stdlib.Mutex.create ();
+    remote = [];
+    remote_rd = rd;
+    remote_wr = wr; }
+
+(* Schedulers of the systhreads of a domain. The last used one is
+   cached in a single field, so a thread switch between reading the
+   thread id and the scheduler can't mix them up. The table is keyed
+   by the thread descriptor, which is unreachable once the thread has
+   exited and is not referenced elsewhere: its entry is then dropped,
+   and the wakeup pipe is closed when nothing refers to the scheduler. *)
+module Threads = Ephemeron.K1.Make (struct
+  type t = Thread.t
+  let equal = ( == )
+  let hash t = Thread.id t
+end)
+
+type domain_scheds = { mutable last : (int * sched) option;
+                       by_thread : sched Threads.t;
+                       lock : Stdlib.Mutex.t; }
+
+let scheds_key = Domain.DLS.new_key (fun () ->
+                     { last = None;
+                       by_thread = Threads.create 4;
+                       lock = Stdlib.Mutex.create () })
+
+let close_sched s =
+  (try Unix.close s.remote_rd with Unix.Unix_error _ -> ());
+  (try Unix.close s.remote_wr with Unix.Unix_error _ -> ())
+
+let sched () =
+  let d = Domain.DLS.get scheds_key in
+  let self = Thread.self () in
+  let tid = Thread.id self in
+  match d.last with
+    Some (t, s) when t = tid -> s
+  | _ ->
+     Stdlib.Mutex.lock d.lock;
+     let s = Fun.protect ~finally:(fun () -> Stdlib.Mutex.unlock d.lock)
+               (fun () ->
+                 match Threads.find_opt d.by_thread self with
+                   Some s -> s
+                 | None ->
+                    let s = new_sched () in
+                    Gc.finalise close_sched s;
+                    Threads.clean d.by_thread;
+                    Threads.replace d.by_thread self s;
+                    s) in
+     d.last <- Some (tid, s);
+     s
+
+let owned name c =
+  let s = sched () in
+  if c.sched != s then invalid_arg name;
+  s
+
+(* Context switch *)
+
+let handler c =
+  { retc = (fun () -> c.state <- Dead; Done);
+    exnc = (fun e -> c.state <- Dead; raise e);
+    effc = (fun (type a) (e : a Effect.t) ->
+      match e with
+        Suspend ->
+         Some (fun (k : (a, action) continuation) ->
+             c.cont <- Some k;
+             c.state <- Sleeping;
+             Done)
+      | Switch (t, v) ->
+         Some (fun (k : (a, action) continuation) ->
+             c.cont <- Some k;
+             c.state <- Sleeping;
+             Run (t, v))
+      | _ -> None) }
+
+(* A transfer returns the next fiber to the resumer instead of
+   continuing it from the handler, so a chain of transfers runs in
+   constant stack. *)
+let rec drive s = function
+    Done -> ()
+  | Run (c, v) ->
+     s.current <- Some c;
+     c.state <- Running;
+     let next =
+       match c.cont, c.start with
+         Some k, _ -> c.cont <- None; continue k v
+       | None, Some f -> c.start <- None; match_with f () (handler c)
+       | None, None -> assert false
+     in
+     drive s next
+
+let switch s c v =
+  let caller = s.current in
+  match drive s (Run (c, v)) with
+    () -> s.current <- caller
+  | exception e -> s.current <- caller; raise e
+
+let suspend s name =
+  if Option.is_none s.current then invalid_arg name;
+  perform Suspend
+
+let yield () =
+  ignore (suspend (sched ()) "Fiber.yield")
+
+let unsafe_yield () =
+  Obj.obj (suspend (sched ()) "Fiber.unsafe_yield")
+
+let resumable name f =
+  let s = owned name f.ctx in
+  if f.ctx.state <> Sleeping then invalid_arg name;
+  s
+
+let resume f =
+  switch (resumable "Fiber.resume" f) f.ctx (Obj.repr ())
+
+let unsafe_resume f v =
+  switch (resumable "Fiber.unsafe_resume" f) f.ctx (Obj.repr v)
+
+let transfer_to name f v =
+  let s = resumable name f in
+  match s.current with
+    Some c when c != f.ctx -> perform (Switch (f.ctx, v))
+  | _ -> invalid_arg name
+
+let transfer f =
+  ignore (transfer_to "Fiber.transfer" f (Obj.repr ()))
+
+let unsafe_transfer f v =
+  Obj.obj (transfer_to "Fiber.unsafe_transfer" f (Obj.repr v))
+
+(* Ready queue *)
+
+let prio_index = function High -> 0 | Normal -> 1 | Low -> 2 | Background -> 3
+
+let wake_ctx c =
+  if c.state <> Dead && not c.pending then begin
+    let s = c.sched in
+    c.pending <- true;
+    s.nready <- s.nready + 1;
+    Queue.push (c, c.seq) s.ready.(c.prio)
+  end
+
+let cancel_ctx c =
+  if c.pending then begin
+    let s = c.sched in
+    c.pending <- false;
+    c.seq <- c.seq + 1;
+    s.nready <- s.nready - 1
+  end
+
+(* drops cancelled wakeups from the head of [q] *)
+let rec ready q =
+  match Queue.peek_opt q with
+    Some (c, seq) when not c.pending || c.seq <> seq ->
+     ignore (Queue.pop q);
+     ready q
+  | Some _ -> true
+  | None -> false
+
+let starve_limit = [| 0; 8; 32; 128 |]
+
+let pick s =
+  let p = ref (-1) in
+  for i = 3 downto 1 do
+    if !p < 0 && s.starve.(i) >= starve_limit.(i) && ready s.ready.(i)
+    then p := i
+  done;
+  if !p < 0 then begin
+    let i = ref 0 in
+    while !p < 0 do
+      if ready s.ready.(!i) then p := !i;
+      incr i
+    done
+  end;
+  for i = !p + 1 to 3 do
+    if ready s.ready.(i) then s.starve.(i) <- s.starve.(i) + 1
+  done;
+  s.starve.(!p) <- 0;
+  let c, _ = Queue.pop s.ready.(!p) in
+  c.pending <- false;
+  s.nready <- s.nready - 1;
+  c
+
+(* every round resumes fibers which were ready when it started *)
+let dispatch s =
+  let start = if s.time > 0. then Unix.gettimeofday () else 0. in
+  let rec round r =
+    let n = s.nready and i = ref 0 in
+    while !i < n && s.nready > 0 && not s.break do
+      let c = pick s in
+      if c.state = Sleeping then switch s c (Obj.repr ());
+      incr i
+    done;
+    if s.nready > 0 && not s.break && r < s.rounds &&
+         (s.time = 0. || Unix.gettimeofday () -. start < s.time)
+    then round (r + 1)
+  in
+  round 1
+
+(* Timers *)
+
+(* moves [t] up from the hole at [i] *)
+let rec sift_up h i t =
+  let p = (i - 1) / 2 in
+  if i > 0 && t.at < h.(p).at then begin
+    h.(i) <- h.(p);
+    h.(i).idx <- i;
+    sift_up h p t
+  end else begin
+    h.(i) <- t;
+    t.idx <- i
+  end
+
+(* moves [t] down from the hole at [i] in a heap of [n] timers *)
+let rec sift_down h n i t =
+  let l = 2 * i + 1 in
+  let m = if l + 1 < n && h.(l + 1).at < h.(l).at then l + 1 else l in
+  if l < n && h.(m).at < t.at then begin
+    h.(i) <- h.(m);
+    h.(i).idx <- i;
+    sift_down h n m t
+  end else begin
+    h.(i) <- t;
+    t.idx <- i
+  end
+
+let timer_start s at fire =
+  let wheel = s.resolution > 0. in
+  let at = if wheel then ceil (at /. s.resolution) *. s.resolution else at in
+  let t = { at; fire; wheel; idx = -1 } in
+  if wheel then s.wheel_timers <- s.wheel_timers + 1;
+  if s.ntimers = Array.length s.timers then begin
+    let h = Array.make (2 * s.ntimers) no_timer in
+    Array.blit s.timers 0 h 0 s.ntimers;
+    s.timers <- h
+  end;
+  s.ntimers <- s.ntimers + 1;
+  sift_up s.timers (s.ntimers - 1) t;
+  t
+
+(* removes [t] from the heap at once, so stopped timers and their
+   closures don't pile up until their deadline *)
+let timer_stop s t =
+  let i = t.idx in
+  if i >= 0 then begin
+    let h = s.timers in
+    t.idx <- -1;
+    if t.wheel then s.wheel_timers <- s.wheel_timers - 1;
+    s.ntimers <- s.ntimers - 1;
+    let last = h.(s.ntimers) in
+    h.(s.ntimers) <- no_timer;
+    if i < s.ntimers then
+      if i > 0 && last.at < h.((i - 1) / 2).at then sift_up h i last
+      else sift_down h s.ntimers i last
+  end
+
+let next_timer s =
+  if s.ntimers = 0 then None else Some s.timers.(0).at
+
+let expire s =
+  let t = now () in
+  let rec loop () =
+    match next_timer s with
+      Some at when at <= t ->
+       let tm = s.timers.(0) in
+       timer_stop s tm;
+       tm.fire ();
+       loop ()
+    | _ -> ()
+  in
+  loop ()
+
+let deadline s d slack =
+  let slack = if slack < 0. then s.slack else slack in
+  let at = now () +. d in
+  if slack > 0. then ceil (at /. slack) *. slack else at
+
+(* Descriptors *)
+
+let bits = function READ -> 1 | WRITE -> 2 | READ_WRITE -> 3
+let event_of_bits = function 1 -> READ | 2 -> WRITE | _ -> READ_WRITE
+
+(* Watches are grouped by descriptor, every descriptor takes one
+   slot of the poll set. A freed slot is filled with the last one. *)
+let watch_start s wfd bits notify =
+  s.watch_seq <- s.watch_seq + 1;
+  let w = { wid = s.watch_seq; wfd; bits; notify } in
+  Hashtbl.replace s.watches w.wid w;
+  begin match Hashtbl.find_opt s.polled wfd with
+    Some p -> p.pwatches <- w :: p.pwatches
+  | None ->
+     let n = s.npolled in
+     if n = Array.length s.pset then begin
+       let pset = Array.make (2 * n) no_polled in
+       Array.blit s.pset 0 pset 0 n;
+       s.pset <- pset;
+       s.pfds <- Array.make (2 * n + 1) s.remote_rd;
+       s.pevents <- Array.make (2 * n + 1) 0
+     end;
+     let p = { pfd = wfd; pwatches = [w]; slot = n } in
+     s.pset.(n) <- p;
+     s.npolled <- n + 1;
+     Hashtbl.replace s.polled wfd p
+  end;
+  w.wid
+
+let watch_stop s id =
+  match Hashtbl.find_opt s.watches id with
+    None -> ()
+  | Some w ->
+     Hashtbl.remove s.watches id;
+     let p = Hashtbl.find s.polled w.wfd in
+     match List.filter (fun x -> x != w) p.pwatches with
+       [] ->
+        Hashtbl.remove s.polled w.wfd;
+        let n = s.npolled - 1 in
+        let last = s.pset.(n) in
+        s.pset.(p.slot) <- last;
+        last.slot <- p.slot;
+        s.pset.(n) <- no_polled;
+        s.npolled <- n
+     | l -> p.pwatches <- l
+
+(* Wakeups from other threads are queued under a lock, the first one
+   after the loop drained the queue writes to a pipe it polls. *)
+let wake_remote_ctx c =
+  let s = c.sched in
+  Stdlib.Mutex.lock s.remote_lock;
+  let first = match s.remote with [] -> true | _ -> false in
+  s.remote <- c :: s.remote;
+  Stdlib.Mutex.unlock s.remote_lock;
+  if first then
+    try ignore (Unix.single_write s.remote_wr (Bytes.make 1 '\000') 0 1)
+    with Unix.Unix_error _ -> ()
+
+let remote_drain s =
+  let buf = Bytes.create 64 in
+  (try while Unix.read s.remote_rd buf 0 64 = 64 do () done
+   with Unix.Unix_error _ -> ());
+  Stdlib.Mutex.lock s.remote_lock;
+  let l = s.remote in
+  s.remote <- [];
+  Stdlib.Mutex.unlock s.remote_lock;
+  List.iter wake_ctx (List.rev l)
+
+external poll_fds : Unix.file_descr array -> int array -> int -> float -> int
+  = "stub_poll"
+
+let poll s =
+  update_now ();
+  let timeout =
+    if s.nready > 0 then 0.
+    else match next_timer s with
+           None -> -1.
+         | Some at -> Float.max 0. (at -. now ())
+  in
+  s.pfds.(0) <- s.remote_rd;
+  s.pevents.(0) <- 1;
+  for i = 0 to s.npolled - 1 do
+    let p = s.pset.(i) in
+    s.pfds.(i + 1) <- p.pfd;
+    s.pevents.(i + 1) <- List.fold_left (fun b w -> b lor w.bits) 0 p.pwatches
+  done;
+  let ready = poll_fds s.pfds s.pevents (s.npolled + 1) timeout in
+  update_now ();
+  if ready > 0 then begin
+    if s.pevents.(0) <> 0 then remote_drain s;
+    (* notify may start and stop watches, pset is not walked then *)
+    let fired = ref [] in
+    for i = s.npolled downto 1 do
+      let b = s.pevents.(i) in
+      if b <> 0 then
+        List.iter (fun w ->
+            if w.bits land b <> 0 then fired := (w, w.bits land b) :: !fired)
+          s.pset.(i - 1).pwatches
+    done;
+    List.iter (fun (w, b) ->
+        if Hashtbl.mem s.watches w.wid then w.notify b) !fired
+  end;
+  expire s
+
+(* Suspends the current fiber until [arm s fire] calls [fire]. [arm]
+   starts watchers and returns a function stopping them. Other
+   wakeups of the fiber return [woken] if given and are ignored
+   otherwise. *)
+let wait_for ?woken name arm =
+  let s = sched () in
+  let c = match s.current with Some c -> c | None -> invalid_arg name in
+  let res = ref None in
+  let fire v = match !res with
+      None -> res := Some v; wake_ctx c
+    | Some _ -> () in
+  let stop = arm s fire in
+  let rec loop () =
+    match !res with
+      Some v -> v
+    | None ->
+       ignore (perform Suspend);
+       match !res, woken with
+         None, Some v -> v
+       | _ -> loop ()
+  in
+  let v = loop () in
+  stop ();
+  v
+
+(* Public API *)
+
+let set_priority_id c p =
+  if c.state = Dead then invalid_arg "Fiber.set_priority";
+  let pending = c.pending in
+  cancel_ctx c;
+  c.prio <- prio_index p;
+  if pending then wake_ctx c
+
+let break () =
+  (sched ()).break <- true
+
+let set_run_budget ?(rounds=max_int) ?(time=0.) () =
+  if rounds < 1 || time < 0. then invalid_arg "Fiber.set_run_budget";
+  let s = sched () in
+  s.rounds <- rounds;
+  s.time <- time
+
+let sleep ?(slack = -1.) d =
+  wait_for "Fiber.sleep" (fun s fire ->
+      let t = timer_start s (deadline s d slack) fire in
+      fun () -> timer_stop s t)
+
+let sleep_until ?(slack = -1.) t =
+  sleep ~slack (t -. now ())
+
+let set_timer_slack slack =
+  if slack < 0. then invalid_arg "Fiber.set_timer_slack";
+  (sched ()).slack <- slack
+
+let set_timer_resolution r =
+  let s = sched () in
+  if r < 0. || s.wheel_timers > 0 then
+    invalid_arg "Fiber.set_timer_resolution";
+  s.resolution <- r
+
+type zombie_stats = { zombies : int;
+                      trimmed : int;
+                      untrimmed_bytes : int;
+                      reclaimed_bytes : int; }
+
+(* there are no native stacks to cache *)
+let trim () = ()
+let zombie_stats () =
+  { zombies = 0; trimmed = 0; untrimmed_bytes = 0; reclaimed_bytes = 0 }
+
+let set_zombie_limits ?(count=max_int) ?(bytes=max_int) () =
+  if count < 0 || bytes < 0 then invalid_arg "Fiber.set_zombie_limits"
+
+type stack_profile = { name : string;
+                       samples : int;
+                       max_depth : int;
+                       histogram : int array; }
+
+let set_stack_profiling (_ : bool) = ()
+let stack_profile () : stack_profile list = []
+
+let stack_percentile p q =
+  if p.samples = 0 then 0 else
+  let n = ceil (q *. float p.samples) in
+  let rec loop k acc =
+    let acc = acc + p.histogram.(k) in
+    if float acc >= n || k = Array.length p.histogram - 1
+    then min (1024 lsl k) p.max_depth
+    else loop (k + 1) acc
+  in
+  loop 0 0
+
+module FQueue = struct
+  include Queue
+  let yield q =
+    let s = sched () in
+    match s.current with
+      Some c ->
+       Queue.push c q;
+       ignore (perform Suspend)
+    | None -> invalid_arg "Fiber.yield"
+
+  let wake q =
+    Queue.iter wake_ctx q;
+    Queue.clear q
+
+  let wake_one q =
+    try wake_ctx (Queue.pop q)
+    with Queue.Empty -> ()
+end
+
+let wake f =
+  ignore (owned "Fiber.wake" f.ctx);
+  if f.ctx.state = Dead then invalid_arg "Fiber.wake";
+  wake_ctx f.ctx
+
+let wake_remote f =
+  wake_remote_ctx f.ctx
+
+let cancel_wake f =
+  ignore (owned "Fiber.cancel_wake" f.ctx);
+  if f.ctx.state = Dead then invalid_arg "Fiber.cancel_wake";
+  cancel_ctx f.ctx
+
+let set_priority f p =
+  ignore (owned "Fiber.set_priority" f.ctx);
+  set_priority_id f.ctx p
+
+let create ?(stack_size=0) ?guard:_ ?name:_ ?(priority=Normal) f v =
+  if stack_size < 0 then invalid_arg "Fiber.create";
+  let ctx = { sched = sched (); state = Sleeping; start = None; cont = None;
+              prio = prio_index priority; pending = false; seq = 0 } in
+  let fiber = { ctx; result = None; joinq = FQueue.create (); } in
+  ctx.start <- Some (fun () ->
+                   fiber.result <- Some (f v);
+                   FQueue.wake fiber.joinq);
+  fiber
+
+let rec join f =
+  match f.result with
+    Some v -> v
+  | None ->
+     FQueue.yield f.joinq;
+     join f
+
+let run ?stack_size ?guard ?name ?priority g a =
+  let f = create ?stack_size ?guard ?name ?priority (fun () ->
+              let v = g a in
+              break ();
+              v) () in
+  wake f;
+  let s = sched () in
+  s.break <- false;
+  update_now ();
+  while not s.break do
+    dispatch s;
+    if not s.break then poll s
+  done;
+  s.break <- false;
+  f.result
+
+let timeout_start s timeout fire =
+  match timeout with
+    None -> ignore
+  | Some d ->
+     let at = deadline s (Float.max 0. d) (-1.) in
+     let t = timer_start s at (fun () -> fire None) in
+     fun () -> timer_stop s t
+
+let wait_io ?timeout fd ev =
+  let r = wait_for ~woken:(Some ev) "Fiber.wait_io" (fun s fire ->
+      let w = watch_start s fd (bits ev) (fun b -> fire (Some (event_of_bits b))) in
+      let stop = timeout_start s timeout fire in
+      fun () -> watch_stop s w; stop ()) in
+  match r with
+    Some ev -> ev
+  | None -> raise Timeout
+
+let wait_io_ready ?timeout fd ev =
+  ignore (wait_io ?timeout fd ev)
+
+let wait_any ?timeout fds =
+  wait_for ~woken:None "Fiber.wait_any" (fun s fire ->
+      let ws = List.map (fun (fd, ev) ->
+          watch_start s fd (bits ev) (fun b -> fire (Some (fd, event_of_bits b))))
+          fds in
+      let stop = timeout_start s timeout fire in
+      fun () -> List.iter (watch_stop s) ws; stop ())
+
+module Fd = struct
+  type t = { fd : Unix.file_descr;
+             owner : sched;
+             mutable closed : bool;
+             waiter : (int * (int -> unit)) option array; (* READ, WRITE *) }
+
+  external send_nosignal : Unix.file_descr -> bytes -> int -> int ->
+                           Unix.msg_flag list -> int = "stub_send_nosignal"
+
+  let register fd =
+    Unix.set_nonblock fd;
+    { fd; owner = sched (); closed = false; waiter = [| None; None |] }
+
+  let unregister t =
+    if t.owner != sched () then invalid_arg "Fiber.Fd.unregister";
+    t.closed <- true;
+    for i = 0 to 1 do
+      match t.waiter.(i) with
+        Some (w, fire) ->
+         t.waiter.(i) <- None;
+         watch_stop t.owner w;
+         fire 0
+      | None -> ()
+    done
+
+  let descr t = t.fd
+
+  (* Returns ready events, 0 if woken by unregister *)
+  let wait_bits name t b =
+    let s = sched () in
+    if Option.is_none s.current || t.closed || t.owner != s then
+      invalid_arg name;
+    for i = 0 to 1 do
+      if b land (1 lsl i) <> 0 && Option.is_some t.waiter.(i) then
+        invalid_arg name
+    done;
+    wait_for name (fun s fire ->
+        let w = watch_start s t.fd b fire in
+        for i = 0 to 1 do
+          if b land (1 lsl i) <> 0 then t.waiter.(i) <- Some (w, fire)
+        done;
+        fun () ->
+          watch_stop s w;
+          for i = 0 to 1 do
+            match t.waiter.(i) with
+              Some (w', _) when w' = w -> t.waiter.(i) <- None
+            | _ -> ()
+          done)
+
+  let wait t ev =
+    ignore (wait_bits "Fiber.Fd.wait" t (bits ev))
+
+  let wait_io t ev =
+    match wait_bits "Fiber.Fd.wait_io" t (bits ev) with
+      0 -> ev
+    | b -> event_of_bits b
+
+  (* tries [call] first, waits only if it would block *)
+  let rec io name t b call =
+    match call () with
+      n -> n
+    | exception Unix.Unix_error (Unix.EINTR, _, _) -> io name t b call
+    | exception (Unix.Unix_error ((Unix.EAGAIN | Unix.EWOULDBLOCK), _, _) as e) ->
+       if Option.is_none (sched ()).current then raise e;
+       ignore (wait_bits ("Fiber.Fd." ^ name) t b);
+       io name t b call
+
+  let check name buf ofs len =
+    if ofs < 0 || len < 0 || ofs > Bytes.length buf - len
+    then invalid_arg name
+
+  let read t buf ofs len =
+    check "Fiber.Fd.read" buf ofs len;
+    io "read" t 1 (fun () -> Unix.read t.fd buf ofs len)
+
+  let write t buf ofs len =
+    check "Fiber.Fd.write" buf ofs len;
+    let rec loop written =
+      if written >= len then written
+      else loop (written + io "write" t 2 (fun () ->
+                     Unix.single_write t.fd buf (ofs + written) (len - written)))
+    in
+    loop 0
+
+  let recv t buf ofs len flags =
+    check "Fiber.Fd.recv" buf ofs len;
+    io "recv" t 1 (fun () -> Unix.recv t.fd buf ofs len flags)
+
+  let send t buf ofs len flags =
+    check "Fiber.Fd.send" buf ofs len;
+    io "send" t 2 (fun () -> send_nosignal t.fd buf ofs len flags)
+
+  let accept t =
+    let c, addr = io "accept" t 1 (fun () -> Unix.accept t.fd) in
+    Unix.set_nonblock c;
+    c, addr
+
+  let use_uring ?(entries=256) () =
+    if entries < 1 then invalid_arg "Fiber.Fd.use_uring";
+    false
+end
+
+(* Jobs are executed by a pool of systhreads shared by all domains,
+   the waiting fiber is woken with wake_remote. *)
+module Blocking = struct
+  let lock = Stdlib.Mutex.create ()
+  let nonempty = Stdlib.Condition.create ()
+  let jobs = Queue.create ()
+  let max_threads = ref 4
+  let threads = ref 0
+  let idle = ref 0
+
+  let set_threads n =
+    if n < 1 then invalid_arg "Fiber.Blocking.set_threads";
+    Stdlib.Mutex.lock lock;
+    max_threads := n;
+    Stdlib.Mutex.unlock lock
+
+  let rec worker () =
+    Stdlib.Mutex.lock lock;
+    incr idle;
+    while Queue.is_empty jobs do
+      Stdlib.Condition.wait nonempty lock
+    done;
+    decr idle;
+    let job = Queue.pop jobs in
+    Stdlib.Mutex.unlock lock;
+    job ();
+    worker ()
+
+  let submit job =
+    Stdlib.Mutex.lock lock;
+    Queue.push job jobs;
+    if !idle = 0 && !threads < !max_threads then begin
+      incr threads;
+      ignore (Thread.create worker ())
+    end else
+      Stdlib.Condition.signal nonempty;
+    Stdlib.Mutex.unlock lock
+
+  (* in initial context [call] blocks the thread *)
+  let call f =
+    match (sched ()).current with
+      None -> f ()
+    | Some c ->
+       let res = Atomic.make None in
+       submit (fun () ->
+           Atomic.set res (Some (try Ok (f ()) with e -> Error e));
+           wake_remote_ctx c);
+       let rec loop () =
+         match Atomic.get res with
+           Some r -> r
+         | None -> ignore (perform Suspend); loop ()
+       in
+       match loop () with
+         Ok v -> v
+       | Error e -> raise e
+
+  let openfile path flags perm =
+    call (fun () -> Unix.openfile path flags perm)
+
+  let read fd buf ofs len =
+    Fd.check "Fiber.Blocking.read" buf ofs len;
+    call (fun () -> Unix.read fd buf ofs len)
+
+  let write fd buf ofs len =
+    Fd.check "Fiber.Blocking.write" buf ofs len;
+    call (fun () -> Unix.single_write fd buf ofs len)
+
+  let fsync fd =
+    call (fun () -> Unix.fsync fd)
+
+  let stat path =
+    call (fun () -> Unix.stat path)
+
+  let getaddrinfo node service opts =
+    call (fun () -> Unix.getaddrinfo node service opts)
+end
+
+include Fiber_sync.Make (struct
+    type nonrec fqueue = fqueue
+    include FQueue
+  end)
+
+let _ =
+  assert(Sys.int_size == 63)
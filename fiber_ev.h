@@ -24,7 +24,7 @@
  * SUCH DAMAGE.
  */
 
-#define EV_MULTIPLICITY 0
+#define EV_MULTIPLICITY 1
 #define EV_CONFIG_H "config.h"
 
 
@@ -32,7 +32,7 @@
 #define EV_STRINGIFY(x) EV_STRINGIFY2(x)
 #define EV_COMMON void *data; char coro; const char *cb_src;
 #define ev_set_cb(ev,cb_) (ev_cb_ (ev) = (cb_), memmove (&((ev_watcher *)(ev))->cb, &ev_cb_ (ev), sizeof (ev_cb_ (ev))), (ev)->cb_src = __FILE__ ":" EV_STRINGIFY(__LINE__))
-#define EV_CB_DECLARE(type) void (*cb)(struct type *w, int revents);
+#define EV_CB_DECLARE(type) void (*cb)(EV_P_ struct type *w, int revents);
 
 #if defined(FIBER_TRACE) || defined(FIBER_EV_DEBUG)
 extern void fiber_ev_cb(void *);
@@ -41,15 +41,39 @@ extern void fiber_ev_cb(void *);
 #define EV_CB_LOG(arg) (void)0
 #endif
 
-#define EV_CB_INVOKE(watcher, revents) ({			\
+#define EV_CB_INVOKE(watcher, revents_) ({			\
 if ((watcher)->coro) {						\
 	fiber = (struct fiber *)(watcher)->cb;				\
 	fiber->coro.w = (watcher);				\
+	fiber->coro.revents = (revents_);			\
 	fiber->caller = sched;					\
 	EV_CB_LOG((watcher));					\
 	coro_transfer(sched_ctx, &fiber->coro.ctx);		\
+	if (__builtin_expect(fiber_killed != NULL, 0))		\
+		fiber_bury();					\
 } else								\
-	(watcher)->cb((watcher), (revents));			\
+	(watcher)->cb(EV_A_ (watcher), (revents_));		\
 })
 
 #include "libev/ev.h"
+
+/* every thread running fibers has its own loop */
+extern __thread struct ev_loop *fiber_ev_loop;
+
+#ifndef FIBER_EV_IMPL
+#define ev_run(flags) ev_run(fiber_ev_loop, (flags))
+#define ev_break(how) ev_break(fiber_ev_loop, (how))
+#define ev_io_start(w) ev_io_start(fiber_ev_loop, (w))
+#define ev_io_stop(w) ev_io_stop(fiber_ev_loop, (w))
+#define ev_timer_start(w) ev_timer_start(fiber_ev_loop, (w))
+#define ev_timer_stop(w) ev_timer_stop(fiber_ev_loop, (w))
+#define ev_idle_start(w) ev_idle_start(fiber_ev_loop, (w))
+#define ev_idle_stop(w) ev_idle_stop(fiber_ev_loop, (w))
+#define ev_prepare_start(w) ev_prepare_start(fiber_ev_loop, (w))
+#define ev_prepare_stop(w) ev_prepare_stop(fiber_ev_loop, (w))
+#define ev_async_start(w) ev_async_start(fiber_ev_loop, (w))
+/* ev_async_send() takes the loop explicitly: it is called from other threads */
+#endif
+
+/* cached monotonic time of the loop, ev_now() is wall clock */
+ev_tstamp fiber_ev_mn_now(void);
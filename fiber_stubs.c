@@ -25,11 +25,28 @@
  */
 
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+/* ELF version constants from <elf.h> clash with libev's event names */
+#undef EV_NONE
+#undef EV_CURRENT
+#undef EV_NUM
+#include <math.h>
 #include <memory.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <ucontext.h>
 // #include <sys/time.h>
 #include <unistd.h>
 
@@ -41,11 +58,26 @@
 #include <caml/alloc.h>
 #include <caml/threads.h>
 #include <caml/fail.h>
+#include <caml/signals.h>
+#include <caml/unixsupport.h>
+#include <caml/socketaddr.h>
+#include <caml/version.h>
 
 #include "fiber.h"
 #include "fiber_ev.h"
 #include "libcoro/coro.h"
 
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/eventfd.h>
+#  include <sys/syscall.h>
+#  if defined(IORING_FEAT_FAST_POLL) && defined(__NR_io_uring_setup)
+#   define FIBER_URING 1
+#  endif
+# endif
+#endif
+
 #if HAVE_VALGRIND_VALGRIND_H && !defined(NVALGRIND)
 # include <valgrind/valgrind.h>
 # include <valgrind/memcheck.h>
@@ -58,36 +90,121 @@
 # define VALGRIND_STACK_REGISTER(_qzz_addr,_qzz_len) (void)0
 #endif
 
-#define MH_SOURCE 1
-#define mh_name _long
-#define mh_key_t long
-#define mh_val_t void *
-#include "mhash.h"
+#if OCAML_VERSION_MAJOR < 5
+
+static size_t page_size;
+
+/* Stacks are grouped into power of 2 size classes, each class has
+   its own zombie cache. */
+#define FIBER_STACK_CLASSES 19
+#define FIBER_STACK_MIN_CLASS 2
+#define FIBER_STACK_DEFAULT_CLASS 7
+
+static int
+stack_class(size_t size)
+{
+	size_t pages = (size + page_size - 1) / page_size;
+	int k = FIBER_STACK_MIN_CLASS;
+	while (k < FIBER_STACK_CLASSES && ((size_t)1 << k) < pages)
+		k++;
+	return k;
+}
+
+/* Stacks are carved out of large chunks, one chunk is shared by
+   stacks of the same class and guard mode. A guard zone below every
+   stack costs 2 VMAs per fiber, which limits number of fibers by
+   vm.max_map_count: guards and stacks alternate, so neighbouring
+   mappings never merge however the guards are placed. Stacks
+   without guard are adjacent to each other,
+   only the lowest one in a chunk has a guard zone below it. Overflow
+   of such stack is detected (after the fact) by a canary word at its
+   bottom. */
+#define FIBER_GUARD_PAGES 16
+#define FIBER_CHUNK_SIZE (32 << 20)
+#define FIBER_STACK_CANARY ((uintptr_t)0x5AFEC0DE5AFEC0DEULL)
+
+static __thread struct stack_pool {
+	char *next, *end; /* unused part of the current chunk */
+	void *free;	  /* slots given back by failed fiber creation */
+} stack_pools[2][FIBER_STACK_CLASSES];
+
+static void *
+stack_pool_alloc(int guard, int class, size_t slot_size)
+{
+	struct stack_pool *pool = &stack_pools[guard][class];
+
+	if (pool->free != NULL) {
+		void *slot = pool->free;
+		pool->free = *(void **)slot;
+		return slot;
+	}
+
+	if (pool->next == pool->end) {
+		size_t n = FIBER_CHUNK_SIZE / slot_size ?: 1;
+		size_t guard_size = guard ? 0 : FIBER_GUARD_PAGES * page_size;
+		char *chunk = mmap(NULL, guard_size + n * slot_size,
+				   PROT_READ | PROT_WRITE | PROT_EXEC,
+				   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		if (chunk == MAP_FAILED)
+			return NULL;
+		if (guard_size && mprotect(chunk, guard_size, PROT_NONE) < 0) {
+			int saved_errno = errno;
+			munmap(chunk, guard_size + n * slot_size);
+			errno = saved_errno;
+			return NULL;
+		}
+		(void)VALGRIND_MAKE_MEM_NOACCESS(chunk, guard_size);
+		pool->next = chunk + guard_size;
+		pool->end = pool->next + n * slot_size;
+	}
+
+	void *slot = pool->next;
+	pool->next += slot_size;
+	return slot;
+}
+
+/* Slots are not returned to the chunk, they are linked through their
+   first word, which is in the guard zone for guarded stacks. */
+static void
+stack_pool_free(int guard, int class, void *slot)
+{
+	struct stack_pool *pool = &stack_pools[guard][class];
+	if (guard)
+		mprotect(slot, FIBER_GUARD_PAGES * page_size,
+			 PROT_READ | PROT_WRITE | PROT_EXEC);
+	*(void **)slot = pool->free;
+	pool->free = slot;
+}
 
 static struct coro *
-coro_alloc(struct coro *coro, void (*f) (void *), void *data)
+coro_alloc(struct coro *coro, void (*f) (void *), void *data, int class, int guard)
 {
-	const int page = sysconf(_SC_PAGESIZE);
+	const int page = page_size;
+	const size_t guard_size = guard ? FIBER_GUARD_PAGES * page : 0;
 
 	assert(coro != NULL);
 	memset(coro, 0, sizeof(*coro));
 
-	coro->mmap_size = page * 128;
-	coro->mmap = mmap(NULL, coro->mmap_size, PROT_READ | PROT_WRITE | PROT_EXEC,
-			  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-
-	if (coro->mmap == MAP_FAILED)
-		goto fail;
+	coro->mmap_size = (page_size << class) + guard_size;
+	coro->mmap = stack_pool_alloc(guard, class, coro->mmap_size);
 
-        /* 16 pages of no access guard zone */
-	if (mprotect(coro->mmap, page * 16, PROT_NONE) < 0)
+	if (coro->mmap == NULL)
 		goto fail;
 
-	(void)VALGRIND_MAKE_MEM_NOACCESS(coro->mmap, page * 16);
+	if (guard) {
+		if (mprotect(coro->mmap, guard_size, PROT_NONE) < 0)
+			goto fail;
+		(void)VALGRIND_MAKE_MEM_NOACCESS(coro->mmap, guard_size);
+		coro->guard = coro->mmap;
+		coro->guard_size = guard_size;
+	} else {
+		coro->canary = coro->mmap;
+		*coro->canary = FIBER_STACK_CANARY;
+	}
 
 	const int red_zone_size = sizeof(void *) * 4;
-	coro->stack = coro->mmap + 16 * page;
-	coro->stack_size = coro->mmap_size - 16 * page - red_zone_size;
+	coro->stack = coro->mmap + guard_size;
+	coro->stack_size = coro->mmap_size - guard_size - red_zone_size;
 	void **red_zone = coro->stack + coro->stack_size;
 	red_zone[0] = red_zone[1] = NULL;
 	red_zone[2] = red_zone[3] = (void *)(uintptr_t)0xDEADDEADDEADDEADULL;
@@ -99,27 +216,119 @@ coro_alloc(struct coro *coro, void (*f) (void *), void *data)
 	int saved_errno;
 fail:
 	saved_errno = errno;
+	if (coro->mmap != NULL)
+		stack_pool_free(guard, class, coro->mmap);
 	coro_destroy(coro);
 	errno = saved_errno;
 	return NULL;
 }
 
 
-SLIST_HEAD(, fiber) fibers, zombie_fibers;
-
-
-struct fiber* sched;
-coro_context *sched_ctx = NULL;
-struct fiber *fiber = NULL;
-static unsigned long last_used_id = 100; /* ids below 99 are reserved */
-
-
-static ev_prepare wake_prep;
-static ev_async wake_async;
-
-static struct mh_long_t *fibers_registry;
+/* Schedulers.
+
+   Every thread which uses fibers has its own scheduler: sched fiber,
+   event loop, run queue, zombie cache and fiber ids are thread local.
+   A scheduler is created on the first call into the library from the
+   thread and is recycled when the thread exits, see
+   fiber_thread_free(). Part of its state is reached from other
+   threads: GC scans fibers of all schedulers, wakeups and blocking
+   pool completions are delivered to the owner loop. That part lives
+   in struct scheduler. */
+struct wake_remote;
+
+struct scheduler {
+	unsigned no; /* part of fiber ids */
+	struct ev_loop *loop;
+	struct fiber *sched;
+	LIST_HEAD(, fiber) fibers; /* live fibers, except sched */
+	SLIST_HEAD(, fiber) dirty_fibers;
+	uintnat stack_usage; /* in words, all suspended fibers */
+	/* taken by the thread to change fibers list and stack_usage
+	   outside of the runtime lock, and by GC of other threads */
+	pthread_mutex_t mutex;
+	ev_async wake_async; /* for wakeups from other threads */
+	struct wake_remote *wake_remote_head;
+	struct fiber_fd *fd_garbage; /* finalized by other threads */
+	/* left by the previous owner thread */
+	unsigned gen; /* highest fiber generation it used */
+	struct stack_pool stack_pools[2][FIBER_STACK_CLASSES];
+	struct scheduler *next_free;
+};
+
+#define FIBER_SCHED_BITS 8
+static struct scheduler *schedulers[1 << FIBER_SCHED_BITS];
+static unsigned schedulers_used;
+static struct scheduler *schedulers_free;
+static pthread_mutex_t schedulers_free_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t scheduler_key; /* runs fiber_thread_free() */
+static __thread struct scheduler *scheduler;
+__thread struct ev_loop *fiber_ev_loop;
+/* the thread holds the runtime lock, see fiber_acquire_runtime() */
+static __thread char runtime_held;
+
+static void fiber_thread_new(void);
+static void fiber_thread_free(void *arg);
+
+/* Every stub which needs the scheduler starts with this */
+static inline void
+fiber_thread_init(void)
+{
+	if (__builtin_expect(scheduler == NULL, 0))
+		fiber_thread_new();
+}
 
-static TAILQ_HEAD(, fiber) wake_list;
+static __thread SLIST_HEAD(, fiber) zombie_fibers[2][FIBER_STACK_CLASSES];
+/* Zombies holding their stack memory, oldest first. When there are
+   more of them than allowed by limits, stacks of the oldest ones are
+   released to the kernel. Trimmed zombies stay in the cache. */
+static __thread TAILQ_HEAD(, fiber) untrimmed_zombies;
+static __thread struct {
+	size_t count, trimmed;
+	size_t untrimmed_bytes, reclaimed_bytes;
+	size_t max_count, max_bytes;
+} zombie_stat = { .max_count = 1024, .max_bytes = 64 << 20 };
+
+
+__thread struct fiber* sched;
+__thread coro_context *sched_ctx = NULL;
+__thread struct fiber *fiber = NULL;
+
+/* Every fiber ever allocated owns a slot in fiber_slab of its
+   scheduler. Slot 0 is taken by sched. Scheduler number is kept in
+   the id, so an id is never valid in another thread. */
+static __thread struct fiber **fiber_slab;
+static __thread unsigned fiber_slab_used, fiber_slab_size;
+#define FIBER_SLOT_BITS 32
+#define FIBER_GEN_BITS 22 /* gen, scheduler and slot must fit into OCaml int */
+#define FIBER_GEN_MASK ((1U << FIBER_GEN_BITS) - 1)
+
+
+static __thread ev_prepare wake_prep;
+static __thread ev_idle wake_idle; /* keeps poll non-blocking while wake_list is not empty */
+
+/* Wake queue, one list per priority, 0 is the highest. A lower
+   priority fiber which was passed over starve_limit[prio] times in a
+   row is resumed before fibers of higher priorities. */
+#define FIBER_PRIORITIES 4
+#define FIBER_PRIORITY_DEFAULT 1
+static __thread TAILQ_HEAD(, fiber) wake_list[FIBER_PRIORITIES];
+static __thread unsigned wake_count;
+static __thread unsigned wake_skipped[FIBER_PRIORITIES];
+static const unsigned starve_limit[FIBER_PRIORITIES] = { 0, 8, 32, 128 };
+
+/* Minor GC promotes every young value reachable from a suspended stack
+   and updates the stack slots in place. After that a stack can get
+   new pointers into the minor heap only if its fiber runs OCaml code
+   again. Such fibers are kept in dirty_fibers and only they are
+   scanned by the minor GC. Major GC and compaction scan everything. */
+static void
+fiber_mark_dirty(struct fiber *f)
+{
+	if (f->dirty)
+		return;
+	f->dirty = 1;
+	SLIST_INSERT_HEAD(&scheduler->dirty_fibers, f, dirty_link);
+}
 
 #if defined(FIBER_TRACE) || defined(FIBER_EV_DEBUG)
 void
@@ -129,18 +338,40 @@ fiber_ev_cb(void *arg)
 }
 #endif
 
+static void fiber_wake_remote_drain(void);
+static void fiber_fd_garbage_drain(void);
+
 static void
-fiber_async_send()
+fiber_async(EV_P_ ev_async* ev __attribute__((unused)),
+            int events __attribute__((unused)))
 {
-        ev_async_send(&wake_async);
+	fiber_wake_remote_drain();
+	fiber_fd_garbage_drain();
 }
 
 static void
-fiber_async(ev_async* ev __attribute__((unused)),
-            int events __attribute__((unused)))
+fiber_idle(EV_P_ ev_idle* ev __attribute__((unused)),
+	   int events __attribute__((unused)))
+{
+}
+
+static void
+fiber_check_canary(struct fiber *f)
 {
+	if (f->coro.canary == NULL || *f->coro.canary == FIBER_STACK_CANARY)
+		return;
+	fprintf(stderr, "fiber %lli/%s: stack overflow\n", f->id, f->name);
+	abort();
 }
 
+/* Fiber killed by the stack overflow handler, it is turned into
+   zombie by fiber_bury() once its caller runs: the handler may
+   interrupt code holding scheduler->mutex or changing the wake list.
+   The caller is suspended either in resume() or, for sched, in
+   EV_CB_INVOKE() (see fiber_ev.h): both bury it right after
+   coro_transfer() returns, before anything else can switch to it. */
+__thread struct fiber *fiber_killed;
+
 void
 #ifdef FIBER_TRACE
 fiber_resume(struct fiber *callee, void *w)
@@ -156,6 +387,8 @@ resume(struct fiber *callee, void *w)
 	fiber = callee;
 	callee->coro.w = w;
 	coro_transfer(&caller->coro.ctx, &callee->coro.ctx);
+	if (__builtin_expect(fiber_killed != NULL, 0))
+		fiber_bury();
 }
 
 void *
@@ -170,12 +403,37 @@ yield(void)
         assert(callee->id != 1);
 	assert(callee->caller != NULL);
 #endif
+	fiber_check_canary(callee);
 	fiber = callee->caller;
 	callee->caller = NULL;
 	coro_transfer(&callee->coro.ctx, &fiber->coro.ctx);
 	return fiber->coro.w;
 }
 
+/* Switch from the current fiber directly to suspended [target]. The
+   target takes over caller of the current fiber, which is left
+   suspended exactly as after yield(). */
+void *
+#ifdef FIBER_TRACE
+fiber_transfer(struct fiber *target, void *w)
+#else
+transfer(struct fiber *target, void *w)
+#endif
+{
+	struct fiber *self = fiber;
+#ifndef FIBER_NDEBUG
+	assert(self->id != 1 && self->caller != NULL);
+	assert(target != sched && target != self && target->caller == NULL);
+#endif
+	fiber_check_canary(self);
+	target->caller = self->caller;
+	self->caller = NULL;
+	fiber = target;
+	target->coro.w = w;
+	coro_transfer(&self->coro.ctx, &target->coro.ctx);
+	return fiber->coro.w;
+}
+
 int
 fiber_wake(struct fiber *f, void *arg)
 {
@@ -187,8 +445,9 @@ fiber_wake(struct fiber *f, void *arg)
 	fprintf(stderr, "%s: %lli/%s arg:%p\n", __func__, f->fid, f->name, arg);
 #endif
 	f->wake = arg;
-	TAILQ_INSERT_TAIL(&wake_list, f, wake_link);
-	fiber_async_send();
+	/* wake_prep drains the list before the loop blocks */
+	TAILQ_INSERT_TAIL(&wake_list[f->priority], f, wake_link);
+	wake_count++;
 	return 1;
 }
 
@@ -199,56 +458,441 @@ fiber_cancel_wake(struct fiber *f)
 	/* see fiber_wake() comment */
 	if (f->wake_link.tqe_prev == NULL)
 		return 0;
-	TAILQ_REMOVE(&wake_list, f, wake_link);
+	TAILQ_REMOVE(&wake_list[f->priority], f, wake_link);
 	f->wake_link.tqe_prev = NULL;
+	wake_count--;
 	return 1;
 }
 
+/* Wakeups from other threads.
+
+   Requests are pushed onto a lock-free stack of the scheduler owning
+   the fiber and taken by its loop thread all at once, so there is no
+   ABA problem. Only the push which finds the stack empty signals
+   wake_async: a burst of wakeups between two loop iterations costs
+   one ev_async_send(). Requests carry fiber id, a fiber which died
+   meanwhile is skipped. */
+struct wake_remote {
+	struct wake_remote *next;
+	long long fid;
+};
+
+/* Takes ownership of [w], w->fid must be set */
+static void
+fiber_wake_remote_push(struct wake_remote *w)
+{
+	unsigned no = w->fid >> FIBER_SLOT_BITS & ((1U << FIBER_SCHED_BITS) - 1);
+	struct scheduler *s = __atomic_load_n(&schedulers[no], __ATOMIC_ACQUIRE);
+	if (s == NULL) {
+		free(w);
+		return;
+	}
+	w->next = __atomic_load_n(&s->wake_remote_head, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&s->wake_remote_head, &w->next, w, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	if (w->next == NULL)
+		ev_async_send(s->loop, &s->wake_async);
+}
+
+int
+fiber_wake_remote(long long fid)
+{
+	struct wake_remote *w = malloc(sizeof(*w));
+	if (w == NULL)
+		return -1;
+	w->fid = fid;
+	fiber_wake_remote_push(w);
+	return 0;
+}
+
+static void
+fiber_wake_remote_drain(void)
+{
+	if (__atomic_load_n(&scheduler->wake_remote_head, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct wake_remote *w = __atomic_exchange_n(&scheduler->wake_remote_head, NULL,
+						    __ATOMIC_ACQUIRE),
+			   *fifo = NULL, *next;
+	for (; w != NULL; w = next) { /* restore order of requests */
+		next = w->next;
+		w->next = fifo;
+		fifo = w;
+	}
+	for (w = fifo; w != NULL; w = next) {
+		next = w->next;
+		struct fiber *f = fid2fiber(w->fid);
+		if (f != NULL && f->id != 1)
+			fiber_wake(f, NULL);
+		free(w);
+	}
+}
+
+/* Timers.
+
+   A timer resumes the current fiber with the timer itself as yield()
+   result. By default it is an ev_timer in libev's heap. When timer
+   resolution is set, timers are kept in a hierarchical timing wheel
+   driven by one periodic ev_timer instead: start and stop are O(1)
+   and expiration is rounded up to the resolution.
+
+   With slack, deadline is rounded up to a multiple of slack on the
+   monotonic clock, so timers expiring within the same window fire in
+   one loop iteration. */
+struct fiber_timer {
+	ev_timer ev; /* must be first, see fiber_timer_start() */
+	TAILQ_ENTRY(fiber_timer) link;
+	TAILQ_HEAD(fiber_timer_list, fiber_timer) *slot; /* NULL if not on wheel */
+	uint64_t expire; /* tick */
+	struct fiber *fiber;
+	char heap; /* ev is used */
+};
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static __thread struct {
+	ev_tstamp resolution; /* 0 if wheel is disabled */
+	ev_tstamp base; /* monotonic time of tick 0 */
+	uint64_t tick; /* last processed tick */
+	unsigned count;
+	struct fiber_timer_list slot[WHEEL_LEVELS][WHEEL_SIZE];
+	ev_timer driver;
+} wheel;
+
+static __thread ev_tstamp timer_slack; /* default slack */
+
+static void
+wheel_insert(struct fiber_timer *t)
+{
+	uint64_t delta = t->expire - wheel.tick, at = t->expire;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 &&
+	       delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+		level++;
+	if (delta >= WHEEL_SPAN) /* will be cascaded down again */
+		at = wheel.tick + WHEEL_SPAN - 1;
+	t->slot = &wheel.slot[level][(at >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	TAILQ_INSERT_TAIL(t->slot, t, link);
+}
+
+static void
+wheel_advance(void)
+{
+	struct fiber_timer_list *slot;
+	struct fiber_timer *t;
+	uint64_t tick = ++wheel.tick;
+
+	/* move timers from the upper levels which are due in this rotation */
+	for (int level = 1; level < WHEEL_LEVELS; level++) {
+		if ((tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+			break;
+		slot = &wheel.slot[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+		while ((t = TAILQ_FIRST(slot)) != NULL) {
+			TAILQ_REMOVE(slot, t, link);
+			wheel_insert(t);
+		}
+	}
+
+	slot = &wheel.slot[0][tick & WHEEL_MASK];
+	while ((t = TAILQ_FIRST(slot)) != NULL) {
+		assert(t->expire == tick);
+		TAILQ_REMOVE(slot, t, link);
+		t->slot = NULL;
+		wheel.count--;
+		resume(t->fiber, t);
+	}
+}
+
+static uint64_t
+wheel_now(void)
+{
+	return (fiber_ev_mn_now() - wheel.base) / wheel.resolution;
+}
+
+static void
+wheel_cb(EV_P_ ev_timer *w __attribute__((unused)),
+	 int revents __attribute__((unused)))
+{
+	uint64_t now = wheel_now();
+	while (wheel.tick < now && wheel.count)
+		wheel_advance();
+	if (wheel.count == 0)
+		ev_timer_stop(&wheel.driver);
+}
+
+static void
+fiber_timer_start(struct fiber_timer *t, ev_tstamp delay, ev_tstamp slack)
+{
+	if (slack < 0)
+		slack = timer_slack;
+	if (slack > 0) {
+		ev_tstamp now = fiber_ev_mn_now(),
+			  at = now + (delay > 0 ? delay : 0),
+			  n = (uint64_t)(at / slack);
+		if (n * slack < at)
+			n++;
+		delay = n * slack - now;
+	}
+	t->fiber = fiber;
+	t->slot = NULL;
+	t->heap = wheel.resolution == 0;
+	if (t->heap) {
+		t->ev.coro = 1;
+		ev_timer_init(&t->ev, (void *)fiber, delay, 0.);
+		ev_timer_start(&t->ev);
+		return;
+	}
+
+	if (wheel.count++ == 0) {
+		/* nothing to fire in between. The driver may be still active
+		   when the last timer fired in this very tick, and libev
+		   forbids ev_timer_set() on an active watcher. */
+		wheel.tick = wheel_now();
+		ev_tstamp next = wheel.base + (wheel.tick + 1) * wheel.resolution;
+		ev_timer_stop(&wheel.driver);
+		ev_timer_set(&wheel.driver, next - fiber_ev_mn_now(), wheel.resolution);
+		ev_timer_start(&wheel.driver);
+	}
+	ev_tstamp at = fiber_ev_mn_now() + (delay > 0 ? delay : 0),
+		  ticks = (at - wheel.base) / wheel.resolution;
+	t->expire = ticks;
+	if (t->expire < ticks) /* round up */
+		t->expire++;
+	if (t->expire <= wheel.tick)
+		t->expire = wheel.tick + 1;
+	wheel_insert(t);
+}
+
+static void
+fiber_timer_stop(struct fiber_timer *t)
+{
+	if (t->heap) {
+		ev_timer_stop(&t->ev);
+	} else if (t->slot != NULL) {
+		TAILQ_REMOVE(t->slot, t, link);
+		t->slot = NULL;
+		if (--wheel.count == 0)
+			ev_timer_stop(&wheel.driver);
+	}
+}
+
 void
-fiber_sleep(ev_tstamp delay)
+fiber_sleep(ev_tstamp delay, ev_tstamp slack)
 {
 	assert(fiber != sched);
-	ev_timer *s, w = { .coro = 1 };
-	ev_timer_init(&w, (void *)fiber, delay, 0.);
-	ev_timer_start(&w);
+	struct fiber_timer t;
+	void *s;
+	fiber_timer_start(&t, delay, slack);
 	s = yield();
-	assert(s == &w);
+	assert(s == &t);
 	(void)s;
-	ev_timer_stop(&w);
+	fiber_timer_stop(&t);
 }
 
 
 struct fiber *
-fid2fiber(int fid)
+fid2fiber(long long fid)
 {
-	unsigned k = mh_long_get(fibers_registry, fid);
-	if (k == mh_end(fibers_registry))
+	unsigned slot = fid & ((1ULL << FIBER_SLOT_BITS) - 1),
+		 no = fid >> FIBER_SLOT_BITS & ((1U << FIBER_SCHED_BITS) - 1);
+	if (scheduler == NULL || no != scheduler->no || slot >= fiber_slab_used)
+		return NULL;
+	struct fiber *f = fiber_slab[slot];
+	/* stale id of a dead fiber: either zombie or reused */
+	if (f->id != fid)
 		return NULL;
-	return mh_long_value(fibers_registry, k);
+	return f;
+}
+
+static int
+fiber_slab_add(struct fiber *f)
+{
+	if (fiber_slab_used == fiber_slab_size) {
+		unsigned size = fiber_slab_size ? fiber_slab_size * 2 : 1024;
+		struct fiber **slab = realloc(fiber_slab, size * sizeof(*slab));
+		if (slab == NULL)
+			return -1;
+		fiber_slab = slab;
+		fiber_slab_size = size;
+	}
+	f->slot = fiber_slab_used++;
+	fiber_slab[f->slot] = f;
+	return 0;
+}
+
+
+static void
+fiber_reset_stack(struct fiber *f)
+{
+	f->top_of_stack = f->bottom_of_stack = f->coro.stack + f->coro.stack_size;
+}
+
+/* Release pages of zombie stack, except the top part: zombie is
+   suspended in fiber_loop() and its frames are still there. Lowest
+   resident page (stack high water mark) is found with mincore(2), so
+   only used part of the stack is touched. */
+static char *
+fiber_zombie_stack_top(struct fiber *f)
+{
+	return (char *)((uintptr_t)f->zombie_sp & ~(page_size - 1)) - page_size;
+}
+
+static void
+fiber_trim(struct fiber *f)
+{
+	assert(f->id == 0 && !f->trimmed);
+	char *lo = (char *)f->coro.stack,
+	     *hi = fiber_zombie_stack_top(f);
+	if (f->coro.canary) /* keep the page with canary */
+		lo += page_size;
+
+	size_t reclaimed = 0;
+	char *hwm = NULL;
+	unsigned char vec[256];
+	for (char *p = lo; p < hi; p += sizeof(vec) * page_size) {
+		size_t len = hi - p < sizeof(vec) * page_size ? hi - p : sizeof(vec) * page_size;
+		if (mincore(p, len, vec) < 0) {
+			hwm = lo;
+			reclaimed = 0;
+			break;
+		}
+		for (size_t i = 0; i < len / page_size; i++) {
+			if (!vec[i])
+				continue;
+			if (hwm == NULL)
+				hwm = p + i * page_size;
+			reclaimed += page_size;
+		}
+	}
+	if (hwm != NULL && madvise(hwm, hi - hwm, MADV_DONTNEED) == 0)
+		zombie_stat.reclaimed_bytes += reclaimed;
+
+	TAILQ_REMOVE(&untrimmed_zombies, f, untrimmed_link);
+	f->trimmed = 1;
+	f->poison_lo = NULL;
+	zombie_stat.trimmed++;
+	zombie_stat.untrimmed_bytes -= f->coro.stack_size;
+}
+
+/* Stack profiling.
+
+   Unused part of the stack is filled with a pattern when fiber is
+   created. When fiber dies, the lowest overwritten word gives depth
+   of the stack it used. Depths are aggregated by fiber name into
+   log2 histograms. Pattern below the lowest overwritten word is
+   intact, so next time only the stack above it is poisoned again. */
+#define FIBER_STACK_POISON ((uintptr_t)0xF1BE5AC4F1BE5AC4ULL)
+#define STACK_PROFILE_BUCKETS 24 /* depth <= 1K << bucket */
+
+static __thread int stack_profiling;
+static __thread struct stack_profile {
+	char name[20];
+	size_t samples, max_depth;
+	size_t hist[STACK_PROFILE_BUCKETS];
+} *stack_profile;
+static __thread int stack_profile_used, stack_profile_size;
+
+static uintptr_t *
+fiber_stack_lo(struct fiber *f)
+{
+	uintptr_t *lo = f->coro.stack;
+	return f->coro.canary ? lo + 1 : lo;
 }
 
 static void
-register_id(struct fiber *fiber)
+fiber_stack_poison(struct fiber *f)
+{
+	uintptr_t *lo = f->poison_lo ?: fiber_stack_lo(f),
+		  *hi = (uintptr_t *)fiber_zombie_stack_top(f);
+	for (uintptr_t *p = lo; p < hi; p++)
+		*p = FIBER_STACK_POISON;
+	f->poison_lo = hi;
+	f->poisoned = 1;
+}
+
+static struct stack_profile *
+stack_profile_get(const char *name)
 {
-	mh_long_put(fibers_registry, fiber->id, fiber, NULL);
+	for (int i = 0; i < stack_profile_used; i++)
+		if (strcmp(stack_profile[i].name, name) == 0)
+			return &stack_profile[i];
+
+	if (stack_profile_used == stack_profile_size) {
+		int size = stack_profile_size ? stack_profile_size * 2 : 16;
+		struct stack_profile *p = realloc(stack_profile, size * sizeof(*p));
+		if (p == NULL)
+			return NULL;
+		stack_profile = p;
+		stack_profile_size = size;
+	}
+	struct stack_profile *p = &stack_profile[stack_profile_used++];
+	memset(p, 0, sizeof(*p));
+	snprintf(p->name, sizeof(p->name), "%s", name);
+	return p;
 }
 
 static void
-unregister_id(struct fiber *fiber)
+fiber_stack_measure(struct fiber *f)
 {
-	mh_long_remove(fibers_registry, fiber->id, NULL);
+	uintptr_t *p = fiber_stack_lo(f);
+	while (p < f->poison_lo && *p == FIBER_STACK_POISON)
+		p++;
+	f->poison_lo = p;
+	f->poisoned = 0;
+
+	size_t depth = (char *)f->coro.stack + f->coro.stack_size - (char *)p;
+	struct stack_profile *prof = stack_profile_get(f->name);
+	if (prof == NULL)
+		return;
+	int k = 0;
+	while (k < STACK_PROFILE_BUCKETS - 1 && depth > (size_t)1024 << k)
+		k++;
+	prof->hist[k]++;
+	prof->samples++;
+	if (depth > prof->max_depth)
+		prof->max_depth = depth;
 }
 
+/* Trims the oldest zombies until the limits hold. [running] is a
+   zombie which still executes on its stack (fiber_loop() has just
+   zombificated it), it is left to the next call. */
+static void
+zombie_limits_enforce(struct fiber *running)
+{
+	struct fiber *f = TAILQ_FIRST(&untrimmed_zombies), *next;
+	while (f != NULL &&
+	       (zombie_stat.count - zombie_stat.trimmed > zombie_stat.max_count ||
+		zombie_stat.untrimmed_bytes > zombie_stat.max_bytes)) {
+		next = TAILQ_NEXT(f, untrimmed_link);
+		if (f != running)
+			fiber_trim(f);
+		f = next;
+	}
+}
 
 static void
 fiber_zombificate(struct fiber *f)
 {
+	if (f->poisoned)
+		fiber_stack_measure(f);
 	strcpy(f->name, "zombie");
-	unregister_id(f);
+	/* runtime lock may be released already */
+	pthread_mutex_lock(&scheduler->mutex);
 	f->id = 0;
+	LIST_REMOVE(f, link);
+	scheduler->stack_usage -= (value *)f->top_of_stack - (value *)f->bottom_of_stack;
+	fiber_reset_stack(f);
+	pthread_mutex_unlock(&scheduler->mutex);
 	// TODO: trash fiber->last_retaddr and friends
-        // TODO: madvise()
-	SLIST_INSERT_HEAD(&zombie_fibers, f, zombie_link);
+	SLIST_INSERT_HEAD(&zombie_fibers[f->stack_guard][f->stack_class], f, zombie_link);
+
+	TAILQ_INSERT_TAIL(&untrimmed_zombies, f, untrimmed_link);
+	zombie_stat.count++;
+	zombie_stat.untrimmed_bytes += f->coro.stack_size;
+	zombie_limits_enforce(fiber);
 }
 
 static value
@@ -271,51 +915,128 @@ fiber_loop(void *data __attribute__((unused)))
 		     arg = fiber->arg;
 		fiber->cb = fiber->arg = 0;
 		fiber_trampoline(cb, arg);
+		fiber->zombie_sp = __builtin_frame_address(0);
 		fiber_zombificate(fiber);
 		yield();	/* give control back to scheduler */
 	}
 }
 
 static struct fiber *
-fiber_create(value cb, value arg)
+fiber_create(value cb, value arg, int stack_class, int stack_guard,
+	     const char *name, int priority)
 {
 	struct fiber *new = NULL;
-
-	if (!SLIST_EMPTY(&zombie_fibers)) {
-		new = SLIST_FIRST(&zombie_fibers);
-		SLIST_REMOVE_HEAD(&zombie_fibers, zombie_link);
+	assert(stack_class < FIBER_STACK_CLASSES);
+	stack_guard = !!stack_guard;
+
+	if (!SLIST_EMPTY(&zombie_fibers[stack_guard][stack_class])) {
+		new = SLIST_FIRST(&zombie_fibers[stack_guard][stack_class]);
+		SLIST_REMOVE_HEAD(&zombie_fibers[stack_guard][stack_class], zombie_link);
+		zombie_stat.count--;
+		if (new->trimmed) {
+			new->trimmed = 0;
+			zombie_stat.trimmed--;
+		} else {
+			TAILQ_REMOVE(&untrimmed_zombies, new, untrimmed_link);
+			zombie_stat.untrimmed_bytes -= new->coro.stack_size;
+		}
 	} else {
 		new = calloc(1, sizeof(struct fiber));
-		if (coro_alloc(&new->coro, fiber_loop, NULL) == NULL) {
-			perror("fiber_create");
-			exit(1);
+		if (new == NULL)
+			return NULL;
+		/* ids of the previous owner of the scheduler stay stale */
+		new->gen = scheduler->gen;
+		if (coro_alloc(&new->coro, fiber_loop, NULL,
+			       stack_class, stack_guard) == NULL) {
+			free(new);
+			return NULL;
 		}
-
-		SLIST_INSERT_HEAD(&fibers, new, link);
+		if (fiber_slab_add(new) < 0) {
+			stack_pool_free(stack_guard, stack_class, new->coro.mmap);
+			free(new);
+			return NULL;
+		}
+		new->stack_class = stack_class;
+		new->stack_guard = stack_guard;
+		new->zombie_sp = new->coro.stack + new->coro.stack_size;
+		fiber_reset_stack(new);
 	}
 
-	new->id = last_used_id++; /* we believe that 2**63 won't overflow */
-	register_id(new);
+	LIST_INSERT_HEAD(&scheduler->fibers, new, link);
+	/* generation is never 0, so the id never clashes with sched's one */
+	new->gen = (new->gen + 1) & FIBER_GEN_MASK ?: 1;
+	new->id = (long long)(new->gen << FIBER_SCHED_BITS | scheduler->no)
+		  << FIBER_SLOT_BITS | new->slot;
 
 	new->cb = cb;
 	new->arg = arg;
+	new->priority = priority;
 	memset(new->name, 0, sizeof(new->name));
+	strncpy(new->name, name, sizeof(new->name) - 1);
+	if (stack_profiling)
+		fiber_stack_poison(new);
+	else
+		new->poison_lo = NULL;
+	fiber_mark_dirty(new); /* cb and arg may be young */
 	return new;
 }
 
+static void
+fiber_set_priority(struct fiber *f, int priority)
+{
+	if (f->wake_link.tqe_prev) {
+		TAILQ_REMOVE(&wake_list[f->priority], f, wake_link);
+		TAILQ_INSERT_TAIL(&wake_list[priority], f, wake_link);
+	}
+	f->priority = priority;
+}
+
+static struct fiber *
+fiber_next_ready(void)
+{
+	int prio = -1;
+	for (int i = 0; i < FIBER_PRIORITIES; i++) {
+		if (TAILQ_EMPTY(&wake_list[i]))
+			continue;
+		if (prio < 0)
+			prio = i;
+		else if (wake_skipped[i] >= starve_limit[i])
+			prio = i; /* lowest starving priority wins */
+	}
+	for (int i = prio + 1; i < FIBER_PRIORITIES; i++)
+		if (!TAILQ_EMPTY(&wake_list[i]))
+			wake_skipped[i]++;
+	wake_skipped[prio] = 0;
+
+	struct fiber *f = TAILQ_FIRST(&wake_list[prio]);
+	TAILQ_REMOVE(&wake_list[prio], f, wake_link);
+	f->wake_link.tqe_prev = NULL;
+	wake_count--;
+	return f;
+}
+
+/* Ready fibers are run in rounds: a round resumes as many fibers as
+   were ready when it started, picking them by priority. Rounds go
+   back to back until wake_list is empty or the budget is exhausted,
+   then the backend is polled. */
+static __thread struct {
+	long rounds;
+	ev_tstamp time; /* 0 means no limit */
+} run_budget = { .rounds = 10 };
+
 static void
 fiber_wakeup_pending(void)
 {
 	assert(fiber == sched);
 	struct fiber *f;
-
-	for(int i=10; i && !TAILQ_EMPTY(&wake_list); i--) {
-		TAILQ_INSERT_TAIL(&wake_list, sched, wake_link);
-		while (1) {
-			f = TAILQ_FIRST(&wake_list);
-			TAILQ_REMOVE(&wake_list, f, wake_link);
-			if (f == sched) break;
-			f->wake_link.tqe_prev = NULL;
+	fiber_wake_remote_drain();
+	ev_tstamp deadline = run_budget.time > 0 ? ev_time() + run_budget.time : 0;
+
+	for (long i = run_budget.rounds; i && wake_count; i--) {
+		if (deadline > 0 && i != run_budget.rounds && ev_time() >= deadline)
+			break;
+		for (unsigned n = wake_count; n && wake_count; n--) {
+			f = fiber_next_ready();
 #ifdef FIBER_TRACE
 			fprintf(stderr, "%s: %lli/%s arg:%p\n", __func__,
 				f->fid, f->name, f->wake);
@@ -324,8 +1045,10 @@ fiber_wakeup_pending(void)
 		}
 	}
 
-	if (!TAILQ_EMPTY(&wake_list))
-		fiber_async_send();
+	if (wake_count)
+		ev_idle_start(&wake_idle);
+	else
+		ev_idle_stop(&wake_idle);
 }
 
 
@@ -339,6 +1062,7 @@ extern char * caml_exception_pointer;
 extern int caml_backtrace_pos;
 extern void * caml_backtrace_buffer;
 extern value caml_backtrace_last_exn;
+extern int caml_backtrace_active;
 
 extern void (*caml_scan_roots_hook) (scanning_action);
 extern void (*caml_enter_blocking_section_hook)(void);
@@ -346,6 +1070,7 @@ extern void (*caml_leave_blocking_section_hook)(void);
 extern int (*caml_try_leave_blocking_section_hook)(void);
 extern uintnat (*caml_stack_usage_hook)(void);
 
+extern void caml_oldify_one(value, value *);
 extern void caml_do_local_roots(scanning_action f, char * bottom_of_stack,
 				uintnat last_retaddr, value * gc_regs,
 				struct caml__roots_block * local_roots);
@@ -366,8 +1091,11 @@ static void fiber_scan_roots(struct fiber *f, scanning_action action)
 	} else {
 		(*action)(f->backtrace_last_exn, &f->backtrace_last_exn);
 
-		/* Don't rescan the stack of the current fiber, it was done already */
-		if (f == fiber)
+		/* Don't rescan the stack of the current fiber, it was done
+		   already. Same for a running fiber of another thread which
+		   gave up the runtime lock without going through the
+		   hooks: its state was saved and is scanned by systhreads. */
+		if (f == fiber || f->last_retaddr == 0xbeef)
 			return;
 
 		assert(f->last_retaddr > 0xffff);
@@ -377,22 +1105,99 @@ static void fiber_scan_roots(struct fiber *f, scanning_action action)
 	}
 }
 
+static void fiber_minor_scan_roots(struct scheduler *s, scanning_action action)
+{
+	struct fiber *f, *running = NULL;
+	while (!SLIST_EMPTY(&s->dirty_fibers)) {
+		f = SLIST_FIRST(&s->dirty_fibers);
+		SLIST_REMOVE_HEAD(&s->dirty_fibers, dirty_link);
+		f->dirty = 0;
+		if (f->id == 0) /* skip zombie */
+			continue;
+		if (f != fiber && !f->cb && f->last_retaddr == 0xbeef)
+			running = f;
+		fiber_scan_roots(f, action);
+	}
+	/* Running fiber of another thread is not scanned here and keeps
+	   running after GC: it may store young pointers on its stack
+	   before it yields, so it stays dirty. */
+	if (running != NULL) {
+		running->dirty = 1;
+		SLIST_INSERT_HEAD(&s->dirty_fibers, running, dirty_link);
+	}
+}
+
 static void fiber_all_scan_roots(scanning_action action)
 {
 	struct fiber *f;
-        fiber_scan_roots(sched, action);
-	SLIST_FOREACH(f, &fibers, link) {
-                if (f->id == 0) /* skip zombie */
-                        continue;
-                fiber_scan_roots(f, action);
-        }
+	for (unsigned i = 0; i < schedulers_used; i++) {
+		struct scheduler *s = __atomic_load_n(&schedulers[i], __ATOMIC_ACQUIRE);
+		if (s == NULL)
+			continue;
+		pthread_mutex_lock(&s->mutex);
+		if (action == caml_oldify_one) {
+			fiber_minor_scan_roots(s, action);
+		} else if (s->sched != NULL) {
+			fiber_scan_roots(s->sched, action);
+			LIST_FOREACH(f, &s->fibers, link)
+				fiber_scan_roots(f, action);
+		}
+		pthread_mutex_unlock(&s->mutex);
+	}
+	/* current fiber continues to run after GC */
+	if (action == caml_oldify_one && scheduler != NULL)
+		fiber_mark_dirty(fiber);
 
 	if (prev_scan_roots_hook != NULL)
 		(*prev_scan_roots_hook)(action);
 }
 
+/* Runtime lock.
+
+   Switching between fibers doesn't touch the runtime lock of
+   systhreads: it is kept by the thread when a fiber yields and is
+   released only when the thread is about to block, i.e. on entering
+   a blocking section or before the loop polls. The next fiber to run
+   OCaml code takes it back. Before the lock is given to systhreads,
+   caml_bottom_of_stack is cleared so that systhreads doesn't scan the
+   stack, it is done with the saved state of the fiber instead. */
 static void
-fiber_enter_blocking_section(void)
+fiber_release_runtime(void)
+{
+	if (!runtime_held)
+		return;
+	runtime_held = 0;
+	caml_bottom_of_stack = NULL;
+	if (prev_enter_blocking_section_hook != NULL)
+		(*prev_enter_blocking_section_hook)();
+}
+
+static inline void
+fiber_acquire_runtime(void)
+{
+	if (runtime_held)
+		return;
+	if (prev_leave_blocking_section_hook != NULL)
+		(*prev_leave_blocking_section_hook)();
+	runtime_held = 1;
+}
+
+static void
+fiber_loop_release(struct ev_loop *loop __attribute__((unused)))
+{
+	fiber_release_runtime();
+}
+
+static void
+fiber_loop_acquire(struct ev_loop *loop __attribute__((unused)))
+{
+}
+
+/* Runtime state which differs between fibers. Backtrace fields are
+   only touched by the runtime while backtraces are recorded, so they
+   are left alone otherwise. */
+static inline void
+fiber_save_runtime(void)
 {
 	fiber->top_of_stack = caml_top_of_stack;
 	fiber->bottom_of_stack = caml_bottom_of_stack;
@@ -401,17 +1206,23 @@ fiber_enter_blocking_section(void)
 	fiber->exception_pointer = caml_exception_pointer;
 	fiber->local_roots = caml_local_roots;
 
-	fiber->backtrace_pos = caml_backtrace_pos;
-	fiber->backtrace_buffer = caml_backtrace_buffer;
-	fiber->backtrace_last_exn = caml_backtrace_last_exn;
+	if (caml_backtrace_active) {
+		fiber->backtrace_pos = caml_backtrace_pos;
+		fiber->backtrace_buffer = caml_backtrace_buffer;
+		fiber->backtrace_last_exn = caml_backtrace_last_exn;
+	}
+
+	scheduler->stack_usage += (value *)fiber->top_of_stack - (value *)fiber->bottom_of_stack;
 
         caml_local_roots = (void *)0xdead;
 	caml_last_return_address = 0xbeef;
 }
 
-static void
-fiber_leave_blocking_section(void)
+static inline void
+fiber_restore_runtime(void)
 {
+	fiber_acquire_runtime();
+
 	caml_top_of_stack = fiber->top_of_stack;
 	caml_bottom_of_stack= fiber->bottom_of_stack;
 	caml_last_return_address = fiber->last_retaddr;
@@ -419,139 +1230,525 @@ fiber_leave_blocking_section(void)
 	caml_exception_pointer = fiber->exception_pointer;
 	caml_local_roots = fiber->local_roots;
 
-	caml_backtrace_pos = fiber->backtrace_pos;
-	caml_backtrace_buffer = fiber->backtrace_buffer;
-	caml_backtrace_last_exn = fiber->backtrace_last_exn;
+	if (caml_backtrace_active) {
+		caml_backtrace_pos = fiber->backtrace_pos;
+		caml_backtrace_buffer = fiber->backtrace_buffer;
+		caml_backtrace_last_exn = fiber->backtrace_last_exn;
+	}
+
+	scheduler->stack_usage -= (value *)fiber->top_of_stack - (value *)fiber->bottom_of_stack;
 
         fiber->local_roots = (void *)0xdead;
 	fiber->last_retaddr = 0xbeef;
+
+	fiber_mark_dirty(fiber);
+}
+
+/* Hooks are shared by all threads, those without a scheduler are
+   passed to systhreads as is. */
+static void
+fiber_enter_blocking_section(void)
+{
+	if (scheduler == NULL) {
+		(*prev_enter_blocking_section_hook)();
+		return;
+	}
+	fiber_save_runtime();
+	fiber_release_runtime();
+}
+
+static void
+fiber_leave_blocking_section(void)
+{
+	if (scheduler == NULL) {
+		(*prev_leave_blocking_section_hook)();
+		return;
+	}
+	fiber_restore_runtime();
 }
 
 static int
 fiber_try_leave_blocking_section(void)
 {
+	if (scheduler == NULL)
+		return (*prev_try_leave_blocking_section_hook)();
+	if (!runtime_held) {
+		if (!(*prev_try_leave_blocking_section_hook)())
+			return 0;
+		runtime_held = 1;
+	}
+	fiber_restore_runtime();
 	return 1;
 }
 
 static uintnat
 fiber_stack_usage(void)
 {
+  /* Stack of the current fiber is not included: its state is not
+     saved and it is accounted elsewhere */
   uintnat sz = 0;
-  struct fiber *f;
-
-  SLIST_FOREACH(f, &fibers, link) {
-          if (f->id == 0) /* skip zombie */
-                  continue;
-	  /* Don't add stack for current thread, this is done elsewhere */
-	  if (f == fiber)
+  for (unsigned i = 0; i < schedulers_used; i++) {
+	  struct scheduler *s = __atomic_load_n(&schedulers[i], __ATOMIC_ACQUIRE);
+	  if (s == NULL)
 		  continue;
-	  sz += (value *) f->top_of_stack - (value *) f->bottom_of_stack;
+	  pthread_mutex_lock(&s->mutex);
+	  sz += s->stack_usage;
+	  pthread_mutex_unlock(&s->mutex);
   }
   if (prev_stack_usage_hook != NULL)
 	  sz += prev_stack_usage_hook();
   return sz;
 }
 
-static struct fiber *
-Fiber_val(value fib)
+/* Hooks are installed on the first use of the library rather than at
+   load time: systhreads replaces enter/leave hooks without chaining
+   them when Thread module is initialized, so fibers must come after
+   it. */
+static void
+fiber_hooks_init(void)
 {
-	int fid = Int_val(Field(fib, 0));
-	return fid2fiber(fid);
+	prev_scan_roots_hook = caml_scan_roots_hook;
+        prev_enter_blocking_section_hook = caml_enter_blocking_section_hook;
+        prev_leave_blocking_section_hook = caml_leave_blocking_section_hook;
+        prev_try_leave_blocking_section_hook = caml_try_leave_blocking_section_hook;
+        prev_stack_usage_hook = caml_stack_usage_hook;
+
+        caml_scan_roots_hook = fiber_all_scan_roots;
+	caml_enter_blocking_section_hook = fiber_enter_blocking_section;
+	caml_leave_blocking_section_hook = fiber_leave_blocking_section;
+	caml_try_leave_blocking_section_hook = fiber_try_leave_blocking_section;
+	caml_stack_usage_hook = fiber_stack_usage;
 }
 
-value
-stub_fiber_sleep(value tm)
+/* Stack overflow.
+
+   Fault inside OCaml code is handled by OCaml's own SIGSEGV handler:
+   caml_top_of_stack is set to the top of fiber stack while fiber is
+   running, so it raises Stack_overflow exactly like for the main
+   stack. Fault inside C code can't be turned into exception, the
+   fiber is killed instead: its C frames are abandoned and control is
+   transferred back to the caller. This is only safe when the frames
+   belong to C stubs: abandoned frames of the runtime (GC, allocation)
+   or of libc (malloc with its arena lock held) would leave the heap
+   or a lock inconsistent, so the process is aborted in these cases.
+   Runtime code is recognized by the caml_ prefix of the nearest
+   exported symbol, libc and the dynamic loader by address ranges
+   collected at startup. The runtime is linked statically into the
+   executable, its symbols are seen by dladdr() only because the
+   library links with -Wl,-E (see dune). Code without a visible
+   symbol can't be classified and aborts too. */
+
+extern char *caml_code_area_start, *caml_code_area_end;
+extern char caml_system__code_begin, caml_system__code_end;
+extern int caml_in_minor_collection;
+
+static struct sigaction prev_segv_action;
+
+static int
+in_ocaml_code(char *pc)
 {
-	CAMLparam1(tm);
-	caml_enter_blocking_section();
-	fiber_sleep(Double_val(tm));
-	caml_leave_blocking_section();
-	CAMLreturn(Val_unit);
+	return (pc >= caml_code_area_start && pc <= caml_code_area_end) ||
+		(pc >= &caml_system__code_begin && pc <= &caml_system__code_end);
 }
 
-value
-stub_fiber_create(value cb, value arg)
+static char *
+context_pc(void *context)
 {
-	CAMLparam2(cb, arg);
-	CAMLlocal1(fib);
-	caml_enter_blocking_section();
-	struct fiber *f = fiber_create(cb, arg);
-	caml_leave_blocking_section();
-	CAMLreturn(Val_int(f->id));
+	ucontext_t *uc = context;
+#if defined(__linux__) && defined(__x86_64__)
+	return (char *)uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__linux__) && defined(__i386__)
+	return (char *)uc->uc_mcontext.gregs[REG_EIP];
+#elif defined(__linux__) && defined(__aarch64__)
+	return (char *)uc->uc_mcontext.pc;
+#else
+	(void)uc;
+	return NULL;
+#endif
 }
 
-value
-stub_fiber_run(value unit)
+static struct {
+	char *lo, *hi;
+} unsafe_code[8];
+static int unsafe_code_count;
+
+static int
+unsafe_code_collect(struct dl_phdr_info *info, size_t size __attribute__((unused)),
+		    void *data __attribute__((unused)))
 {
-	caml_enter_blocking_section();
-	ev_run(0);
-	caml_leave_blocking_section();
-	return Val_unit;
+	void *probes[] = { (void *)malloc, (void *)free, (void *)write,
+			   (void *)pthread_mutex_lock, (void *)dladdr };
+	char *lo = (char *)-1, *hi = NULL;
+	int unsafe = strstr(info->dlpi_name, "/ld-") != NULL;
+
+	/* the main executable is where the stubs are */
+	if (info->dlpi_name[0] == '\0' || unsafe_code_count == 8)
+		return 0;
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+		if (ph->p_type != PT_LOAD)
+			continue;
+		char *b = (char *)info->dlpi_addr + ph->p_vaddr;
+		if (b < lo)
+			lo = b;
+		if (b + ph->p_memsz > hi)
+			hi = b + ph->p_memsz;
+	}
+	for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++)
+		if ((char *)probes[i] >= lo && (char *)probes[i] < hi)
+			unsafe = 1;
+	if (unsafe) {
+		unsafe_code[unsafe_code_count].lo = lo;
+		unsafe_code[unsafe_code_count].hi = hi;
+		unsafe_code_count++;
+	}
+	return 0;
 }
 
-value
-stub_yield(value init)
+static int
+fiber_killable(char *pc)
 {
-        if (fiber->id == 1)
-                caml_invalid_argument("Fiber.yield");
-	caml_enter_blocking_section();
-	yield();
-	caml_leave_blocking_section();
-	return Val_unit;
+	for (int i = 0; i < unsafe_code_count; i++)
+		if (pc >= unsafe_code[i].lo && pc < unsafe_code[i].hi)
+			return 0;
+	Dl_info info;
+	if (!dladdr(pc, &info) || info.dli_sname == NULL ||
+	    strncmp(info.dli_sname, "caml_", 5) == 0)
+		return 0;
+	return !caml_in_minor_collection;
 }
 
-value
-stub_unsafe_yield(value unit)
+/* stdio is not async-signal-safe */
+static void
+fiber_segv_message(struct fiber *f, const char *msg)
 {
-        CAMLparam1(unit);
-        CAMLlocal1(result);
-        if (fiber->id == 1)
-		caml_invalid_argument("Fiber.unsafe_yield");
-        caml_enter_blocking_section();
-	result = (intptr_t)yield();
+	char buf[128], num[24], *p = buf, *n = num + sizeof(num);
+	unsigned long long id = f->id;
+	do
+		*--n = '0' + id % 10;
+	while (id /= 10);
+	const char *parts[] = { "fiber ", n, "/", f->name, msg };
+	for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+		size_t len = i == 1 ? (size_t)(num + sizeof(num) - n) : strlen(parts[i]);
+		if (len > (size_t)(buf + sizeof(buf) - p))
+			len = buf + sizeof(buf) - p;
+		memcpy(p, parts[i], len);
+		p += len;
+	}
+	ssize_t r = write(STDERR_FILENO, buf, p - buf);
+	(void)r;
+}
+
+static void
+fiber_kill(struct fiber *f)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGSEGV);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+	fiber_segv_message(f, ": stack overflow, fiber killed\n");
+
+	struct fiber *caller = f->caller;
+	/* A running fiber's stack is not accounted in stack_usage, unless
+	   it is in a blocking section: then fiber_save_runtime() added it
+	   and fiber_zombificate() subtracts it. */
+	if (f->last_retaddr == 0xbeef)
+		f->bottom_of_stack = f->top_of_stack;
+	f->zombie_sp = f->coro.stack + f->coro.stack_size;
+	fiber_killed = f;
+
+	coro_context dead;
+	fiber = caller;
+	f->caller = NULL;
+	coro_transfer(&dead, &caller->coro.ctx);
+	abort(); /* not reached */
+}
+
+void
+fiber_bury(void)
+{
+	struct fiber *f = fiber_killed;
+	fiber_killed = NULL;
+	fiber_cancel_wake(f);
+	fiber_zombificate(f);
+	/* restart the context from scratch, it will be reused as usual */
+	coro_create(&f->coro.ctx, fiber_loop, NULL, f->coro.stack, f->coro.stack_size);
+}
+
+static void
+fiber_segv_handler(int signo, siginfo_t *info, void *context)
+{
+	struct fiber *f = fiber;
+	char *addr = info->si_addr, *pc = context_pc(context);
+
+	if (f != sched && f->coro.guard != NULL &&
+	    addr >= (char *)f->coro.guard &&
+	    addr < (char *)f->coro.guard + f->coro.guard_size &&
+	    pc != NULL && !in_ocaml_code(pc)) {
+		if (fiber_killable(pc))
+			fiber_kill(f);
+		fiber_segv_message(f, ": stack overflow in the runtime or libc\n");
+		abort();
+	}
+
+	if (prev_segv_action.sa_flags & SA_SIGINFO) {
+		prev_segv_action.sa_sigaction(signo, info, context);
+	} else if (prev_segv_action.sa_handler != SIG_DFL &&
+		   prev_segv_action.sa_handler != SIG_IGN) {
+		prev_segv_action.sa_handler(signo);
+	} else {
+		/* return and let the fault happen again */
+		signal(SIGSEGV, SIG_DFL);
+	}
+}
+
+/* Must be called after OCaml runtime installed its handler, i.e. not
+   from fiber_init(). Alternate stack is per thread, the handler is
+   installed once. */
+static __thread void *segv_altstack; /* if allocated here */
+
+static void
+fiber_segv_init(void)
+{
+	static int done;
+
+	stack_t ss;
+	if (sigaltstack(NULL, &ss) == 0 && (ss.ss_flags & SS_DISABLE)) {
+		ss.ss_size = SIGSTKSZ < 65536 ? 65536 : SIGSTKSZ;
+		ss.ss_sp = malloc(ss.ss_size);
+		ss.ss_flags = 0;
+		if (ss.ss_sp == NULL || sigaltstack(&ss, NULL) < 0) {
+			free(ss.ss_sp);
+			return;
+		}
+		segv_altstack = ss.ss_sp;
+	}
+
+	if (done++)
+		return;
+	dl_iterate_phdr(unsafe_code_collect, NULL);
+	struct sigaction sa = { .sa_sigaction = fiber_segv_handler,
+				.sa_flags = SA_SIGINFO | SA_ONSTACK };
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &prev_segv_action);
+}
+
+static struct fiber *
+Fiber_val(value fib)
+{
+	return fid2fiber(Long_val(Field(fib, 0)));
+}
+
+value
+stub_fiber_sleep(double tm, double slack)
+{
+	fiber_thread_init();
+	caml_enter_blocking_section();
+	fiber_sleep(tm, slack);
 	caml_leave_blocking_section();
+	return Val_unit;
+}
+
+value
+stub_fiber_sleep_byte(value tm, value slack)
+{
+	return stub_fiber_sleep(Double_val(tm), Double_val(slack));
+}
+
+double
+stub_now(value unit __attribute__((unused)))
+{
+	/* noalloc: can't create the scheduler here */
+	if (fiber_ev_loop == NULL) {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec + ts.tv_nsec * 1e-9;
+	}
+	return fiber_ev_mn_now();
+}
+
+value
+stub_now_byte(value unit)
+{
+	return caml_copy_double(stub_now(unit));
+}
+
+value
+stub_fiber_create(value cb, value arg, value stack_size, value guard,
+		  value name, value priority)
+{
+	CAMLparam5(cb, arg, stack_size, guard, name);
+	CAMLxparam1(priority);
+	fiber_thread_init();
+	int class = FIBER_STACK_DEFAULT_CLASS;
+	if (Long_val(stack_size) < 0)
+		caml_invalid_argument("Fiber.create");
+	if (Long_val(stack_size) > 0)
+		class = stack_class(Long_val(stack_size));
+	if (class >= FIBER_STACK_CLASSES)
+		caml_invalid_argument("Fiber.create");
+	/* runtime lock is kept: fibers list is scanned by GC of other threads */
+	struct fiber *f = fiber_create(cb, arg, class, Bool_val(guard),
+				       String_val(name), Int_val(priority));
+	if (f == NULL)
+		caml_failwith("Fiber.create");
+	CAMLreturn(Val_long(f->id));
+}
+
+value
+stub_fiber_create_byte(value *argv, int argn __attribute__((unused)))
+{
+	return stub_fiber_create(argv[0], argv[1], argv[2],
+				 argv[3], argv[4], argv[5]);
+}
+
+value
+stub_set_priority(value fid, value priority)
+{
+	struct fiber *f = fid2fiber(Long_val(fid));
+	if (f == NULL || f == sched)
+		caml_invalid_argument("Fiber.set_priority");
+	fiber_set_priority(f, Int_val(priority));
+	return Val_unit;
+}
+
+value
+stub_fiber_run(value unit)
+{
+	fiber_thread_init();
+	caml_enter_blocking_section();
+	ev_run(0);
+	caml_leave_blocking_section();
+	return Val_unit;
+}
+
+/* Switching between fibers doesn't block the thread, so the stubs
+   below save and restore runtime state directly instead of entering
+   a blocking section. Pending signals are still processed before the
+   switch, as caml_enter_blocking_section() did: fibers ping-ponging
+   in non-allocating loops may never reach another poll point. */
+static inline void
+fiber_poll_signals(void)
+{
+#if OCAML_VERSION_MINOR < 10
+	caml_process_pending_signals();
+#else
+	caml_process_pending_actions();
+#endif
+}
+
+value
+stub_yield(value init)
+{
+	fiber_thread_init();
+	fiber_poll_signals();
+        if (fiber->id == 1)
+                caml_invalid_argument("Fiber.yield");
+	fiber_save_runtime();
+	yield();
+	fiber_restore_runtime();
+	return Val_unit;
+}
+
+value
+stub_unsafe_yield(value unit)
+{
+        CAMLparam1(unit);
+        CAMLlocal1(result);
+	fiber_thread_init();
+	fiber_poll_signals();
+        if (fiber->id == 1)
+		caml_invalid_argument("Fiber.unsafe_yield");
+        fiber_save_runtime();
+	result = (intptr_t)yield();
+	fiber_restore_runtime();
         CAMLreturn(result);
 }
 
 value
 stub_resume(value fib)
 {
+	CAMLparam1(fib);
+	fiber_thread_init();
+	fiber_poll_signals();
 	struct fiber *f = Fiber_val(fib);
 	if (f == NULL || f->caller != NULL)
 		caml_invalid_argument("Fiber.resume");
-	caml_enter_blocking_section();
+	fiber_save_runtime();
 	resume(f, NULL);
-	caml_leave_blocking_section();
-	return Val_unit;
+	fiber_restore_runtime();
+	CAMLreturn(Val_unit);
 }
 
 value
 stub_unsafe_resume(value fib, value arg)
 {
         CAMLparam2(fib, arg);
+	fiber_thread_init();
+	fiber_poll_signals();
 	struct fiber *f = Fiber_val(fib);
 	if (f == NULL || f->caller != NULL)
 		caml_invalid_argument("Fiber.unsafe_resume");
-	caml_enter_blocking_section();
+	fiber_save_runtime();
 	resume(f, (void *)arg);
-	caml_leave_blocking_section();
+	fiber_restore_runtime();
+	CAMLreturn(Val_unit);
+}
+
+value
+stub_transfer(value fib)
+{
+	CAMLparam1(fib);
+	fiber_thread_init();
+	fiber_poll_signals();
+	struct fiber *f = Fiber_val(fib);
+	if (fiber->id == 1 || f == NULL || f == fiber || f->caller != NULL)
+		caml_invalid_argument("Fiber.transfer");
+	fiber_save_runtime();
+	transfer(f, NULL);
+	fiber_restore_runtime();
 	CAMLreturn(Val_unit);
 }
 
+value
+stub_unsafe_transfer(value fib, value arg)
+{
+	CAMLparam2(fib, arg);
+	CAMLlocal1(result);
+	fiber_thread_init();
+	fiber_poll_signals();
+	struct fiber *f = Fiber_val(fib);
+	if (fiber->id == 1 || f == NULL || f == fiber || f->caller != NULL)
+		caml_invalid_argument("Fiber.unsafe_transfer");
+	fiber_save_runtime();
+	result = (intptr_t)transfer(f, (void *)arg);
+	fiber_restore_runtime();
+	CAMLreturn(result);
+}
+
 value
 stub_wake(value fid)
 {
-	struct fiber *f = fid2fiber(Int_val(fid));
+	struct fiber *f = fid2fiber(Long_val(fid));
 	if (f == NULL)
 		caml_invalid_argument("Fiber.wake");
 	fiber_wake(f, NULL);
 	return Val_unit;
 }
 
+value
+stub_wake_remote(value fid)
+{
+	if (fiber_wake_remote(Long_val(fid)) < 0)
+		caml_raise_out_of_memory();
+	return Val_unit;
+}
+
 value
 stub_cancel_wake(value fid)
 {
-	struct fiber *f = fid2fiber(Int_val(fid));
+	struct fiber *f = fid2fiber(Long_val(fid));
 	if (f == NULL)
 		caml_invalid_argument("Fiber.cancel_wake");
 	fiber_cancel_wake(f);
@@ -561,69 +1758,1485 @@ stub_cancel_wake(value fid)
 value
 stub_fiber_id(value unit)
 {
-	return Val_int(fiber->id);
+	fiber_thread_init();
+	return Val_long(fiber->id);
+}
+
+value
+stub_trim(value unit)
+{
+	fiber_thread_init();
+	while (!TAILQ_EMPTY(&untrimmed_zombies))
+		fiber_trim(TAILQ_FIRST(&untrimmed_zombies));
+	return Val_unit;
+}
+
+value
+stub_set_zombie_limits(value count, value bytes)
+{
+	fiber_thread_init();
+	if (Long_val(count) < 0 || Long_val(bytes) < 0)
+		caml_invalid_argument("Fiber.set_zombie_limits");
+	zombie_stat.max_count = Long_val(count);
+	zombie_stat.max_bytes = Long_val(bytes);
+	zombie_limits_enforce(NULL);
+	return Val_unit;
+}
+
+value
+stub_zombie_stats(value unit)
+{
+	value r = caml_alloc_small(4, 0);
+	Field(r, 0) = Val_long(zombie_stat.count);
+	Field(r, 1) = Val_long(zombie_stat.trimmed);
+	Field(r, 2) = Val_long(zombie_stat.untrimmed_bytes);
+	Field(r, 3) = Val_long(zombie_stat.reclaimed_bytes);
+	return r;
+}
+
+value
+stub_set_stack_profiling(value on)
+{
+	stack_profiling = Bool_val(on);
+	if (stack_profiling)
+		stack_profile_used = 0;
+	return Val_unit;
+}
+
+value
+stub_stack_profile(value unit)
+{
+	CAMLparam1(unit);
+	CAMLlocal4(list, cell, prof, hist);
+	list = Val_emptylist;
+	for (int i = stack_profile_used - 1; i >= 0; i--) {
+		struct stack_profile *p = &stack_profile[i];
+		hist = caml_alloc(STACK_PROFILE_BUCKETS, 0);
+		for (int k = 0; k < STACK_PROFILE_BUCKETS; k++)
+			Store_field(hist, k, Val_long(p->hist[k]));
+		prof = caml_alloc(4, 0);
+		Store_field(prof, 0, caml_copy_string(p->name));
+		Store_field(prof, 1, Val_long(p->samples));
+		Store_field(prof, 2, Val_long(p->max_depth));
+		Store_field(prof, 3, hist);
+		cell = caml_alloc(2, 0);
+		Store_field(cell, 0, prof);
+		Store_field(cell, 1, list);
+		list = cell;
+	}
+	CAMLreturn(list);
+}
+
+value
+stub_set_run_budget(value rounds, value time)
+{
+	if (Long_val(rounds) < 1 || Double_val(time) < 0)
+		caml_invalid_argument("Fiber.set_run_budget");
+	run_budget.rounds = Long_val(rounds);
+	run_budget.time = Double_val(time);
+	return Val_unit;
+}
+
+value
+stub_set_timer_resolution(value resolution)
+{
+	fiber_thread_init();
+	if (Double_val(resolution) < 0 || wheel.count > 0)
+		caml_invalid_argument("Fiber.set_timer_resolution");
+	wheel.resolution = Double_val(resolution);
+	wheel.base = fiber_ev_mn_now();
+	wheel.tick = 0;
+	return Val_unit;
+}
+
+value
+stub_set_timer_slack(value slack)
+{
+	if (Double_val(slack) < 0)
+		caml_invalid_argument("Fiber.set_timer_slack");
+	timer_slack = Double_val(slack);
+	return Val_unit;
 }
 
 value
 stub_break(value unit)
 {
+	fiber_thread_init();
 	ev_break(EVBREAK_ALL);
 	return Val_unit;
 }
 
+static int
+io_mode(value mode_value)
+{
+	static const int mode[] = { EV_READ, EV_WRITE, EV_READ | EV_WRITE };
+	assert(Int_val(mode_value) >= 0 && Int_val(mode_value) <= 2);
+	return mode[Int_val(mode_value)];
+}
+
+static value
+Val_io_event(int revents)
+{
+	if ((revents & (EV_READ | EV_WRITE)) == (EV_READ | EV_WRITE))
+		return Val_int(2);
+	return Val_int(revents & EV_READ ? 0 : 1);
+}
+
+/* Waits until one of [n] descriptors is ready or [timeout] (if not
+   NaN) expires, negative timeout expires at once. Both kinds of
+   watchers resume the current fiber directly, the watcher passed to
+   yield() tells which one fired. Returns index of the ready watcher
+   and its events in [revents], -1 on timeout or -2 if the fiber was
+   resumed by anybody else (e.g. Fiber.wake). */
+static int
+fiber_wait_io(ev_io *io, int n, ev_tstamp timeout, int *revents)
+{
+	struct fiber_timer timer;
+	int ready = -2;
+	for (int i = 0; i < n; i++)
+		ev_io_start(&io[i]);
+	if (!isnan(timeout))
+		fiber_timer_start(&timer, timeout > 0 ? timeout : 0, -1);
+	fiber_save_runtime();
+	void *w = yield();
+	fiber_restore_runtime();
+	if (w == &timer && !isnan(timeout))
+		ready = -1;
+	for (int i = 0; i < n; i++)
+		if (w == &io[i])
+			ready = i;
+	if (!isnan(timeout))
+		fiber_timer_stop(&timer);
+	for (int i = 0; i < n; i++)
+		ev_io_stop(&io[i]);
+	if (revents != NULL)
+		*revents = fiber->coro.revents;
+	return ready;
+}
+
+/* Returns ready event or -1 on timeout */
 value
-stub_wait_io_ready(value fd_value, value mode_value)
+stub_wait_io(value fd_value, value mode_value, value timeout)
 {
-	int mode;
-	switch (Int_val(mode_value)) {
-	case 0: mode = EV_READ; break;
-	case 1: mode = EV_WRITE; break;
-	default: assert(0);
-	}
+	fiber_thread_init();
+	int revents;
+	if (fiber->id == 1)
+		caml_invalid_argument("Fiber.wait_io");
  	ev_io io = { .coro = 1 };
-	ev_io_init(&io, (void *)fiber, Int_val(fd_value), mode);
-	ev_io_start(&io);
+	ev_io_init(&io, (void *)fiber, Int_val(fd_value), io_mode(mode_value));
+	int ready = fiber_wait_io(&io, 1, Double_val(timeout), &revents);
+	if (ready < 0)
+		return Val_int(ready);
+	return Val_io_event(revents);
+}
+
+value
+stub_wait_any(value fds, value timeout)
+{
+	CAMLparam2(fds, timeout);
+	CAMLlocal2(pair, res);
+	fiber_thread_init();
+	int n = Wosize_val(fds);
+	if (fiber->id == 1)
+		caml_invalid_argument("Fiber.wait_any");
+	ev_io *io = calloc(n, sizeof(*io));
+	if (io == NULL)
+		caml_raise_out_of_memory();
+	for (int i = 0; i < n; i++) {
+		value fd = Field(fds, i);
+		io[i].coro = 1;
+		ev_io_init(&io[i], (void *)fiber, Int_val(Field(fd, 0)),
+			   io_mode(Field(fd, 1)));
+	}
+	int revents, ready = fiber_wait_io(io, n, Double_val(timeout), &revents);
+	free(io);
+	if (ready < 0)
+		CAMLreturn(Val_int(0)); /* None */
+	pair = caml_alloc_tuple(2);
+	Store_field(pair, 0, Val_int(ready));
+	Store_field(pair, 1, Val_io_event(revents));
+	res = caml_alloc_small(1, 0);
+	Field(res, 0) = pair;
+	CAMLreturn(res);
+}
+
+/* Registered descriptors.
+
+   Every registered descriptor has one ev_io which stays started while
+   fibers wait on it, so a steady-state read loop doesn't change the
+   backend interest set. An event nobody waits for is dropped from the
+   watcher mask, otherwise level-triggered backend would report it on
+   every iteration. */
+struct fiber_fd {
+	ev_io io;
+	struct fiber *waiter[2]; /* indexed by event: READ, WRITE */
+	struct uring_op *uop[2]; /* pending io_uring operations */
+	struct scheduler *owner; /* io is started in its loop */
+	struct fiber_fd *next_garbage; /* see fiber_fd_finalize() */
+	char sock;
+	char closed;
+	char in_cb, finalized; /* finalizer may run while a waiter is resumed */
+};
+
+static const int fiber_fd_events[2] = { EV_READ, EV_WRITE };
+
+#define Fiber_fd_val(v) (*(struct fiber_fd **)Data_custom_val(v))
+
+static int
+fiber_fd_get_events(struct fiber_fd *fd)
+{
+	return fd->io.events & (EV_READ | EV_WRITE);
+}
+
+static void
+fiber_fd_set_events(struct fiber_fd *fd, int events)
+{
+	if (fiber_fd_get_events(fd) == events)
+		return;
+	ev_io_stop(&fd->io);
+	ev_io_set(&fd->io, fd->io.fd, events);
+	if (events)
+		ev_io_start(&fd->io);
+}
+
+static void
+fiber_fd_cb(EV_P_ ev_io *io, int revents)
+{
+	struct fiber_fd *fd = (struct fiber_fd *)io;
+	int unwanted = 0;
+	fd->in_cb = 1;
+	for (int i = 0; i < 2; i++) {
+		if (!(revents & fiber_fd_events[i]))
+			continue;
+		struct fiber *f = fd->waiter[i];
+		if (f == NULL) {
+			unwanted |= fiber_fd_events[i];
+			continue;
+		}
+		/* fiber waiting for both events is resumed once */
+		f->coro.revents = 0;
+		for (int j = i; j < 2; j++)
+			if (fd->waiter[j] == f && (revents & fiber_fd_events[j])) {
+				fd->waiter[j] = NULL;
+				f->coro.revents |= fiber_fd_events[j];
+			}
+		resume(f, io);
+		if (fd->closed)
+			break;
+	}
+	fd->in_cb = 0;
+	if (fd->finalized)
+		free(fd);
+	else if (unwanted && !fd->closed)
+		fiber_fd_set_events(fd, fiber_fd_get_events(fd) & ~unwanted);
+}
+
+static void uring_cancel(struct uring_op *op);
+
+static void
+fiber_fd_close(struct fiber_fd *fd)
+{
+	if (fd->closed)
+		return;
+	fd->closed = 1;
+	ev_io_stop(&fd->io);
+	for (int i = 0; i < 2; i++)
+		if (fd->uop[i] != NULL)
+			uring_cancel(fd->uop[i]);
+	for (int i = 0; i < 2; i++) {
+		if (fd->waiter[i] != NULL)
+			fiber_wake(fd->waiter[i], NULL);
+		fd->waiter[i] = NULL;
+	}
+}
+
+/* GC may finalize descriptor of another thread. Its watcher can be
+   stopped only by the owner, so it is passed over like remote
+   wakeups. */
+static void
+fiber_fd_finalize(value v)
+{
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	if (fd->owner != scheduler && !fd->closed) {
+		struct scheduler *s = fd->owner;
+		fd->next_garbage = __atomic_load_n(&s->fd_garbage, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&s->fd_garbage, &fd->next_garbage, fd,
+						    1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		ev_async_send(s->loop, &s->wake_async);
+		return;
+	}
+	fiber_fd_close(fd);
+	if (fd->in_cb)
+		fd->finalized = 1;
+	else
+		free(fd);
+}
+
+static struct custom_operations fiber_fd_ops = {
+	"fiber.fd",
+	fiber_fd_finalize,
+	custom_compare_default,
+	custom_hash_default,
+	custom_serialize_default,
+	custom_deserialize_default,
+	custom_compare_ext_default
+};
+
+value
+stub_fd_register(value fd_value)
+{
+	CAMLparam1(fd_value);
+	CAMLlocal1(v);
+	fiber_thread_init();
+	int flags = fcntl(Int_val(fd_value), F_GETFL);
+	if (flags < 0 ||
+	    fcntl(Int_val(fd_value), F_SETFL, flags | O_NONBLOCK) < 0)
+		uerror("Fiber.Fd.register", Nothing);
+	struct stat st;
+	if (fstat(Int_val(fd_value), &st) < 0)
+		uerror("Fiber.Fd.register", Nothing);
+	struct fiber_fd *fd = calloc(1, sizeof(*fd));
+	if (fd == NULL)
+		caml_raise_out_of_memory();
+	ev_io_init(&fd->io, fiber_fd_cb, Int_val(fd_value), 0);
+	fd->owner = scheduler;
+	fd->sock = S_ISSOCK(st.st_mode);
+	v = caml_alloc_custom(&fiber_fd_ops, sizeof(fd), 0, 1);
+	Fiber_fd_val(v) = fd;
+	CAMLreturn(v);
+}
+
+static void
+fiber_fd_garbage_drain(void)
+{
+	struct fiber_fd *fd = __atomic_exchange_n(&scheduler->fd_garbage, NULL,
+						  __ATOMIC_ACQUIRE), *next;
+	for (; fd != NULL; fd = next) {
+		next = fd->next_garbage;
+		fiber_fd_close(fd);
+		free(fd);
+	}
+}
+
+value
+stub_fd_unregister(value v)
+{
+	if (Fiber_fd_val(v)->owner != scheduler)
+		caml_invalid_argument("Fiber.Fd.unregister");
+	fiber_fd_close(Fiber_fd_val(v));
+	return Val_unit;
+}
+
+value
+stub_fd_descr(value v)
+{
+	return Val_int(Fiber_fd_val(v)->io.fd);
+}
+
+/* Returns ready events, 0 if resumed by someone else */
+static int
+fiber_fd_wait(value v, int events, const char *fn)
+{
+	CAMLparam1(v);
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	if (fiber->id == 1 || fd->closed || fd->owner != scheduler)
+		caml_invalid_argument(fn);
+	for (int i = 0; i < 2; i++)
+		if ((events & fiber_fd_events[i]) && fd->waiter[i] != NULL)
+			caml_invalid_argument(fn);
+	for (int i = 0; i < 2; i++)
+		if (events & fiber_fd_events[i])
+			fd->waiter[i] = fiber;
+	fiber_fd_set_events(fd, fiber_fd_get_events(fd) | events);
+	fiber->coro.revents = 0;
 	stub_yield(Val_unit);
-	ev_io_stop(&io);
+	for (int i = 0; i < 2; i++)
+		if (fd->waiter[i] == fiber)
+			fd->waiter[i] = NULL;
+	CAMLreturnT(int, fiber->coro.revents);
+}
+
+value
+stub_fd_wait(value v, value mode_value)
+{
+	fiber_thread_init();
+	fiber_fd_wait(v, io_mode(mode_value), "Fiber.Fd.wait");
 	return Val_unit;
 }
 
+value
+stub_fd_wait_io(value v, value mode_value)
+{
+	fiber_thread_init();
+	int revents = fiber_fd_wait(v, io_mode(mode_value), "Fiber.Fd.wait_io");
+	/* woken by unregister */
+	if (revents == 0)
+		revents = io_mode(mode_value);
+	return Val_io_event(revents);
+}
+
+/* io_uring engine.
+
+   When enabled, an operation on a registered descriptor which would
+   block is submitted to io_uring instead of waiting for readiness and
+   retrying: the kernel completes it and the fiber is woken with the
+   result. Submissions are batched and flushed by a prepare watcher
+   which runs after all fibers of the iteration, completions are
+   signalled through an eventfd watched by the loop. Data goes through
+   a C buffer, OCaml one may move while the fiber waits. */
+struct uring_op {
+	struct fiber *fiber;
+	int res;
+	char done;
+};
+
+#ifdef FIBER_URING
+static __thread struct {
+	int fd, efd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries, to_submit;
+	void *sq, *cq;
+	size_t sq_size, cq_size;
+	ev_io efd_io;
+	ev_prepare submit_prep;
+} uring = { .fd = -1 };
 
-__attribute__((constructor))
 static void
-fiber_init(void)
+uring_submit(void)
+{
+	while (uring.to_submit) {
+		int n = syscall(__NR_io_uring_enter, uring.fd, uring.to_submit,
+				0, 0, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* EAGAIN/EBUSY: kernel is short of resources, retry
+			   on the next iteration */
+			ev_idle_start(&wake_idle);
+			return;
+		}
+		uring.to_submit -= n;
+	}
+}
+
+static int
+uring_sq_full(unsigned tail)
+{
+	return tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.sq_entries;
+}
+
+static void uring_reap(EV_P_ ev_io *w, int revents);
+
+/* Returns -1 if submission queue is full and can't be flushed: the
+   kernel is short of resources (EAGAIN) or completion queue overflowed
+   (EBUSY) and reaping it didn't help. */
+static int
+uring_push(const struct io_uring_sqe *tmpl)
 {
-	SLIST_INIT(&fibers);
-	SLIST_INIT(&zombie_fibers);
-	TAILQ_INIT(&wake_list);
+	unsigned tail = *uring.sq_tail;
+	if (uring_sq_full(tail)) {
+		uring_submit();
+		if (uring_sq_full(tail)) {
+			uring_reap(fiber_ev_loop, &uring.efd_io, 0);
+			uring_submit();
+		}
+		if (uring_sq_full(tail))
+			return -1;
+	}
+	unsigned idx = tail & *uring.sq_mask;
+	uring.sqes[idx] = *tmpl;
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.to_submit++;
+	return 0;
+}
 
-	fibers_registry = mh_long_init(realloc);
+static void
+uring_reap(EV_P_ ev_io *w __attribute__((unused)),
+	   int revents __attribute__((unused)))
+{
+	uint64_t count;
+	while (read(uring.efd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+	unsigned head = *uring.cq_head;
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+		struct uring_op *op = (void *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(uring.cq_head, ++head, __ATOMIC_RELEASE);
+		if (op == NULL) /* cancel request */
+			continue;
+		op->res = res;
+		op->done = 1;
+		fiber_wake(op->fiber, NULL);
+	}
+}
 
-	sched = calloc(1, sizeof(struct fiber));
+static void
+uring_submit_cb(EV_P_ ev_prepare *w __attribute__((unused)),
+		int revents __attribute__((unused)))
+{
+	uring_submit();
+}
+
+static int
+uring_supported(int fd)
+{
+	static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE,
+				   IORING_OP_RECV, IORING_OP_SEND,
+				   IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL };
+	size_t size = sizeof(struct io_uring_probe) +
+		      IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int ok = probe != NULL &&
+		 syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+			 probe, IORING_OP_LAST) == 0;
+	for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+		ok = ops[i] <= probe->last_op &&
+		     (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+static int
+uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_FAST_POLL) || !uring_supported(fd))
+		goto fail;
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned),
+	       cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+	       sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  fd, IORING_OFF_CQ_RING);
+	uring.sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED)
+		goto fail; /* mappings die with the process, never reused */
+
+	uring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (uring.efd < 0)
+		goto fail;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+		    &uring.efd, 1) < 0) {
+		close(uring.efd);
+		goto fail;
+	}
+
+	uring.sq_head = sq + p.sq_off.head;
+	uring.sq_tail = sq + p.sq_off.tail;
+	uring.sq_mask = sq + p.sq_off.ring_mask;
+	uring.sq_array = sq + p.sq_off.array;
+	uring.cq_head = cq + p.cq_off.head;
+	uring.cq_tail = cq + p.cq_off.tail;
+	uring.cq_mask = cq + p.cq_off.ring_mask;
+	uring.cqes = cq + p.cq_off.cqes;
+	uring.sq_entries = p.sq_entries;
+	uring.sq = sq;
+	uring.cq = cq;
+	uring.sq_size = sq_size;
+	uring.cq_size = cq_size;
+	uring.fd = fd;
+
+	ev_io_init(&uring.efd_io, uring_reap, uring.efd, EV_READ);
+	ev_io_start(&uring.efd_io);
+	ev_prepare_init(&uring.submit_prep, uring_submit_cb);
+	ev_set_priority(&uring.submit_prep, EV_MINPRI); /* after wake_prep */
+	ev_prepare_start(&uring.submit_prep);
+	return 0;
+fail:
+	close(fd);
+	return -1;
+}
+
+static int
+uring_enabled(void)
+{
+	return uring.fd >= 0;
+}
+
+/* On thread exit, nothing is in flight */
+static void
+uring_free(void)
+{
+	if (!uring_enabled())
+		return;
+	ev_io_stop(&uring.efd_io);
+	ev_prepare_stop(&uring.submit_prep);
+	munmap(uring.sqes, uring.sq_entries * sizeof(struct io_uring_sqe));
+	munmap(uring.sq, uring.sq_size);
+	munmap(uring.cq, uring.cq_size);
+	close(uring.efd);
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+/* Returns result of operation: non-negative or -errno */
+static int
+uring_io(struct fiber_fd *fd, int i, struct io_uring_sqe *sqe)
+{
+	struct uring_op op = { .fiber = fiber };
+	if (fd->uop[i] != NULL)
+		return -EBUSY;
+	sqe->fd = fd->io.fd;
+	sqe->user_data = (uintptr_t)&op;
+	if (uring_push(sqe) < 0)
+		return -EAGAIN; /* wait for readiness instead */
+	fd->uop[i] = &op;
+	fiber_save_runtime();
+	/* op lives on the stack: ignore unrelated wakeups */
+	while (!op.done)
+		yield();
+	fiber_restore_runtime();
+	fd->uop[i] = NULL;
+	return op.res;
+}
+
+static void
+uring_cancel(struct uring_op *op)
+{
+	struct io_uring_sqe sqe = {
+		.opcode = IORING_OP_ASYNC_CANCEL,
+		.fd = -1,
+		.addr = (uintptr_t)op,
+	};
+	/* if the queue is stuck the operation completes by itself, its
+	   fiber waits for that */
+	(void)uring_push(&sqe);
+}
+
+static int
+uring_rw(struct fiber_fd *fd, int i, int opcode, void *buf, size_t len, int flags)
+{
+	struct io_uring_sqe sqe = {
+		.opcode = opcode,
+		.addr = (uintptr_t)buf,
+		.len = len,
+		.msg_flags = flags,
+	};
+	return uring_io(fd, i, &sqe);
+}
+
+static int
+uring_accept(struct fiber_fd *fd, struct sockaddr *sa, socklen_t *len)
+{
+	struct io_uring_sqe sqe = {
+		.opcode = IORING_OP_ACCEPT,
+		.addr = (uintptr_t)sa,
+		.addr2 = (uintptr_t)len,
+		.accept_flags = SOCK_NONBLOCK,
+	};
+	return uring_io(fd, 0, &sqe);
+}
+
+#define URING_READ(fd) ((fd)->sock ? IORING_OP_RECV : IORING_OP_READ)
+#define URING_WRITE(fd) ((fd)->sock ? IORING_OP_SEND : IORING_OP_WRITE)
+#else
+static int uring_init(unsigned entries __attribute__((unused))) { return -1; }
+static int uring_enabled(void) { return 0; }
+static void uring_free(void) {}
+static void uring_cancel(struct uring_op *op __attribute__((unused))) {}
+static int
+uring_rw(struct fiber_fd *fd __attribute__((unused)), int i __attribute__((unused)),
+	 int opcode __attribute__((unused)), void *buf __attribute__((unused)),
+	 size_t len __attribute__((unused)), int flags __attribute__((unused)))
+{
+	return -EAGAIN;
+}
+static int
+uring_accept(struct fiber_fd *fd __attribute__((unused)),
+	     struct sockaddr *sa __attribute__((unused)),
+	     socklen_t *len __attribute__((unused)))
+{
+	return -EAGAIN;
+}
+#define URING_READ(fd) 0
+#define URING_WRITE(fd) 0
+#endif
+
+value
+stub_fd_use_uring(value entries)
+{
+	fiber_thread_init();
+	if (Int_val(entries) < 1)
+		caml_invalid_argument("Fiber.Fd.use_uring");
+	return Val_bool(uring_enabled() || uring_init(Int_val(entries)) == 0);
+}
+
+/* I/O on registered descriptors: the syscall is tried first and the
+   fiber waits only if it returns EAGAIN, either for readiness or for
+   io_uring to complete [uring_call]. Only sockets go to io_uring:
+   read/write of a non-blocking pipe or tty fails there with EAGAIN
+   too, a wasted round trip. Data goes directly to and from OCaml
+   buffer, the pointer is recomputed after every wait. In initial
+   context EAGAIN is raised as Unix_error. */
+#define FIBER_FD_IO(fn, v, i, call, uring_call) ({			\
+	ssize_t ret;							\
+	while ((ret = (call)) < 0) {					\
+		if (errno == EINTR)					\
+			continue;					\
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) ||	\
+		    fiber->id == 1)					\
+			uerror(fn, Nothing);				\
+		if (uring_enabled() && Fiber_fd_val(v)->sock &&	\
+		    Fiber_fd_val(v)->owner == scheduler) {		\
+			ret = (uring_call);				\
+			if (ret >= 0)					\
+				break;					\
+			if (ret == -EBUSY)				\
+				caml_invalid_argument("Fiber.Fd." fn);	\
+			if (ret != -EAGAIN)				\
+				unix_error(-ret, fn, Nothing);		\
+		}							\
+		fiber_fd_wait(v, fiber_fd_events[i], "Fiber.Fd." fn);	\
+	}								\
+	ret;								\
+})
+
+/* uring operation with a C buffer, copied to OCaml [buf] on success */
+#define URING_READ_TO(fd, op, buf, ofs, len, flags) ({			\
+	void *tmp = malloc((len) ?: 1);					\
+	int res = tmp ? uring_rw(fd, 0, op, tmp, len, flags) : -ENOMEM; \
+	if (res > 0)							\
+		memcpy(&Byte(buf, ofs), tmp, res);			\
+	free(tmp);							\
+	res;								\
+})
+
+#define URING_WRITE_FROM(fd, op, buf, ofs, len, flags) ({		\
+	void *tmp = malloc((len) ?: 1);					\
+	if (tmp)							\
+		memcpy(tmp, &Byte(buf, ofs), len);			\
+	int res = tmp ? uring_rw(fd, 1, op, tmp, len, flags) : -ENOMEM; \
+	free(tmp);							\
+	res;								\
+})
+
+static int msg_flag_table[] = { MSG_OOB, MSG_DONTROUTE, MSG_PEEK };
+
+value
+stub_fd_read(value v, value buf, value ofs, value len)
+{
+	CAMLparam4(v, buf, ofs, len);
+	fiber_thread_init();
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	ssize_t n = FIBER_FD_IO("read", v, 0,
+				read(fd->io.fd, &Byte(buf, Long_val(ofs)), Long_val(len)),
+				URING_READ_TO(fd, URING_READ(fd), buf, Long_val(ofs),
+					      Long_val(len), 0));
+	CAMLreturn(Val_long(n));
+}
+
+value
+stub_fd_write(value v, value buf, value ofs, value len)
+{
+	CAMLparam4(v, buf, ofs, len);
+	fiber_thread_init();
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	long done = 0;
+	while (done < Long_val(len))
+		done += FIBER_FD_IO("write", v, 1,
+				    write(fd->io.fd, &Byte(buf, Long_val(ofs) + done),
+					  Long_val(len) - done),
+				    URING_WRITE_FROM(fd, URING_WRITE(fd), buf,
+						     Long_val(ofs) + done,
+						     Long_val(len) - done,
+						     fd->sock ? MSG_NOSIGNAL : 0));
+	CAMLreturn(Val_long(done));
+}
+
+value
+stub_fd_recv(value v, value buf, value ofs, value len, value flags)
+{
+	CAMLparam5(v, buf, ofs, len, flags);
+	fiber_thread_init();
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	int cflags = caml_convert_flag_list(flags, msg_flag_table);
+	ssize_t n = FIBER_FD_IO("recv", v, 0,
+				recv(fd->io.fd, &Byte(buf, Long_val(ofs)), Long_val(len),
+				     cflags),
+				URING_READ_TO(fd, IORING_OP_RECV, buf, Long_val(ofs),
+					      Long_val(len), cflags));
+	CAMLreturn(Val_long(n));
+}
+
+value
+stub_fd_send(value v, value buf, value ofs, value len, value flags)
+{
+	CAMLparam5(v, buf, ofs, len, flags);
+	fiber_thread_init();
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	int cflags = caml_convert_flag_list(flags, msg_flag_table) | MSG_NOSIGNAL;
+	ssize_t n = FIBER_FD_IO("send", v, 1,
+				send(fd->io.fd, &Byte(buf, Long_val(ofs)), Long_val(len),
+				     cflags),
+				URING_WRITE_FROM(fd, IORING_OP_SEND, buf, Long_val(ofs),
+						 Long_val(len), cflags));
+	CAMLreturn(Val_long(n));
+}
+
+value
+stub_fd_accept(value v)
+{
+	CAMLparam1(v);
+	CAMLlocal2(addr, res);
+	fiber_thread_init();
+	union sock_addr_union sa;
+	socklen_param_type sa_len = sizeof(sa);
+	struct fiber_fd *fd = Fiber_fd_val(v);
+	int c = FIBER_FD_IO("accept", v, 0,
+			    accept4(fd->io.fd, &sa.s_gen, &sa_len, SOCK_NONBLOCK),
+			    (sa_len = sizeof(sa), uring_accept(fd, &sa.s_gen, &sa_len)));
+	addr = alloc_sockaddr(&sa, sa_len, c);
+	res = caml_alloc_tuple(2);
+	Store_field(res, 0, Val_int(c));
+	Store_field(res, 1, addr);
+	CAMLreturn(res);
+}
+
+
+/* Blocking calls.
+
+   Calls which may block (disk I/O, name resolution) are executed by a
+   pool of threads, which never touch the OCaml runtime. The pool is
+   shared by all schedulers. Pool is started on first use, workers
+   idle for BLOCKING_IDLE seconds exit. Completion is delivered like
+   Fiber.wake_remote(): by fiber id, so a scheduler recycled by
+   another thread never sees it. The job lives on the stack of the
+   requesting fiber, the worker doesn't touch it after setting
+   [done]. In initial context calls are executed synchronously. */
+#define BLOCKING_IDLE 10
+
+struct blocking_job {
+	struct blocking_job *next;
+	void (*fn)(struct blocking_job *);
+	struct wake_remote *wake; /* preallocated, pushed by the worker */
+	char done;
+
+	int fd, flags, mode;
+	char *path, *serv;
+	void *buf;
+	size_t len;
+	struct stat st;
+	struct addrinfo hints, *ai;
+	long ret;
+	int err;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct blocking_job *head, **tail; /* pending */
+	int queued, idle, threads, max_threads;
+} blocking = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.tail = &blocking.head,
+	.max_threads = 4,
+};
+
+static void *
+blocking_worker(void *arg __attribute__((unused)))
+{
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+	pthread_mutex_lock(&blocking.mutex);
+	while (42) {
+		struct blocking_job *job = blocking.head;
+		if (job == NULL) {
+			/* surplus after set_threads */
+			if (blocking.threads > blocking.max_threads)
+				break;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += BLOCKING_IDLE;
+			blocking.idle++;
+			int rc = pthread_cond_timedwait(&blocking.cond, &blocking.mutex, &ts);
+			blocking.idle--;
+			if (rc == ETIMEDOUT && blocking.head == NULL)
+				break;
+			continue;
+		}
+		blocking.head = job->next;
+		if (blocking.head == NULL)
+			blocking.tail = &blocking.head;
+		blocking.queued--;
+		pthread_mutex_unlock(&blocking.mutex);
+
+		job->fn(job);
+
+		struct wake_remote *w = job->wake;
+		__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+		fiber_wake_remote_push(w);
+
+		pthread_mutex_lock(&blocking.mutex);
+	}
+	blocking.threads--;
+	pthread_mutex_unlock(&blocking.mutex);
+	return NULL;
+}
+
+static void
+blocking_run(struct blocking_job *job)
+{
+	pthread_t tid;
+	if (fiber->id == 1 || (job->wake = malloc(sizeof(*job->wake))) == NULL) {
+		job->fn(job);
+		return;
+	}
+
+	pthread_mutex_lock(&blocking.mutex);
+	if (blocking.queued >= blocking.idle &&
+	    blocking.threads < blocking.max_threads &&
+	    pthread_create(&tid, NULL, blocking_worker, NULL) == 0) {
+		pthread_detach(tid);
+		blocking.threads++;
+	}
+	if (blocking.threads == 0) {
+		pthread_mutex_unlock(&blocking.mutex);
+		free(job->wake);
+		job->fn(job);
+		return;
+	}
+	job->wake->fid = fiber->id;
+	job->done = 0;
+	job->next = NULL;
+	*blocking.tail = job;
+	blocking.tail = &job->next;
+	blocking.queued++;
+	pthread_cond_signal(&blocking.cond);
+	pthread_mutex_unlock(&blocking.mutex);
+
+	/* job lives on the stack: ignore unrelated wakeups */
+	while (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+		yield();
+}
+
+#define BLOCKING_RET(job, call) ({	\
+	(job)->ret = (call);		\
+	(job)->err = errno;		\
+})
+
+static void job_open(struct blocking_job *j) { BLOCKING_RET(j, open(j->path, j->flags, j->mode)); }
+static void job_read(struct blocking_job *j) { BLOCKING_RET(j, read(j->fd, j->buf, j->len)); }
+static void job_write(struct blocking_job *j) { BLOCKING_RET(j, write(j->fd, j->buf, j->len)); }
+static void job_fsync(struct blocking_job *j) { BLOCKING_RET(j, fsync(j->fd)); }
+static void job_stat(struct blocking_job *j) { BLOCKING_RET(j, stat(j->path, &j->st)); }
+static void job_getaddrinfo(struct blocking_job *j)
+{
+	j->ret = getaddrinfo(j->path, j->serv, &j->hints, &j->ai);
+}
+
+static void
+blocking_call(struct blocking_job *job, void (*fn)(struct blocking_job *))
+{
+	job->fn = fn;
+	caml_enter_blocking_section();
+	blocking_run(job);
+	caml_leave_blocking_section();
+}
+
+value
+stub_blocking_set_threads(value n)
+{
+	if (Int_val(n) < 1)
+		caml_invalid_argument("Fiber.Blocking.set_threads");
+	pthread_mutex_lock(&blocking.mutex);
+	blocking.max_threads = Int_val(n);
+	pthread_cond_broadcast(&blocking.cond); /* let surplus workers exit */
+	pthread_mutex_unlock(&blocking.mutex);
+	return Val_unit;
+}
+
+/* Order of Unix.open_flag constructors */
+static int open_flag_table[] = {
+	O_RDONLY, O_WRONLY, O_RDWR, O_NONBLOCK, O_APPEND, O_CREAT, O_TRUNC,
+	O_EXCL, O_NOCTTY, O_DSYNC, O_SYNC, O_RSYNC, 0 /* O_SHARE_DELETE */,
+	O_CLOEXEC, 0 /* O_KEEPEXEC */
+};
+
+value
+stub_blocking_open(value path, value flags, value perm)
+{
+	CAMLparam3(path, flags, perm);
+	fiber_thread_init();
+	struct blocking_job job = {
+		.flags = caml_convert_flag_list(flags, open_flag_table),
+		.mode = Int_val(perm),
+		.path = strdup(String_val(path)),
+	};
+	if (job.path == NULL)
+		caml_raise_out_of_memory();
+	blocking_call(&job, job_open);
+	free(job.path);
+	if (job.ret < 0)
+		unix_error(job.err, "open", path);
+	CAMLreturn(Val_int(job.ret));
+}
+
+value
+stub_blocking_read(value fd, value buf, value ofs, value len)
+{
+	CAMLparam4(fd, buf, ofs, len);
+	fiber_thread_init();
+	/* OCaml buffer may move while fiber waits */
+	struct blocking_job job = {
+		.fd = Int_val(fd),
+		.len = Long_val(len),
+		.buf = malloc(Long_val(len) ?: 1),
+	};
+	if (job.buf == NULL)
+		caml_raise_out_of_memory();
+	blocking_call(&job, job_read);
+	if (job.ret > 0)
+		memcpy(&Byte(buf, Long_val(ofs)), job.buf, job.ret);
+	free(job.buf);
+	if (job.ret < 0)
+		unix_error(job.err, "read", Nothing);
+	CAMLreturn(Val_long(job.ret));
+}
+
+value
+stub_blocking_write(value fd, value buf, value ofs, value len)
+{
+	CAMLparam4(fd, buf, ofs, len);
+	fiber_thread_init();
+	struct blocking_job job = {
+		.fd = Int_val(fd),
+		.len = Long_val(len),
+		.buf = malloc(Long_val(len) ?: 1),
+	};
+	if (job.buf == NULL)
+		caml_raise_out_of_memory();
+	memcpy(job.buf, &Byte(buf, Long_val(ofs)), job.len);
+	blocking_call(&job, job_write);
+	free(job.buf);
+	if (job.ret < 0)
+		unix_error(job.err, "write", Nothing);
+	CAMLreturn(Val_long(job.ret));
+}
+
+value
+stub_blocking_fsync(value fd)
+{
+	CAMLparam1(fd);
+	fiber_thread_init();
+	struct blocking_job job = { .fd = Int_val(fd) };
+	blocking_call(&job, job_fsync);
+	if (job.ret < 0)
+		unix_error(job.err, "fsync", Nothing);
+	CAMLreturn(Val_unit);
+}
+
+static value
+alloc_stats(struct stat *st)
+{
+	CAMLparam0();
+	CAMLlocal1(v);
+	int kind;
+	switch (st->st_mode & S_IFMT) {
+	case S_IFDIR: kind = 1; break;
+	case S_IFCHR: kind = 2; break;
+	case S_IFBLK: kind = 3; break;
+	case S_IFLNK: kind = 4; break;
+	case S_IFIFO: kind = 5; break;
+	case S_IFSOCK: kind = 6; break;
+	default: kind = 0; break; /* S_REG */
+	}
+	v = caml_alloc(12, 0);
+	Store_field(v, 0, Val_int(st->st_dev));
+	Store_field(v, 1, Val_int(st->st_ino));
+	Store_field(v, 2, Val_int(kind));
+	Store_field(v, 3, Val_int(st->st_mode & 07777));
+	Store_field(v, 4, Val_int(st->st_nlink));
+	Store_field(v, 5, Val_int(st->st_uid));
+	Store_field(v, 6, Val_int(st->st_gid));
+	Store_field(v, 7, Val_int(st->st_rdev));
+	Store_field(v, 8, Val_long(st->st_size));
+	Store_field(v, 9, caml_copy_double(st->st_atim.tv_sec + st->st_atim.tv_nsec / 1e9));
+	Store_field(v, 10, caml_copy_double(st->st_mtim.tv_sec + st->st_mtim.tv_nsec / 1e9));
+	Store_field(v, 11, caml_copy_double(st->st_ctim.tv_sec + st->st_ctim.tv_nsec / 1e9));
+	CAMLreturn(v);
+}
+
+value
+stub_blocking_stat(value path)
+{
+	CAMLparam1(path);
+	fiber_thread_init();
+	struct blocking_job job = { .path = strdup(String_val(path)) };
+	if (job.path == NULL)
+		caml_raise_out_of_memory();
+	blocking_call(&job, job_stat);
+	free(job.path);
+	if (job.ret < 0)
+		unix_error(job.err, "stat", path);
+	CAMLreturn(alloc_stats(&job.st));
+}
+
+/* Order of Unix.socket_domain and Unix.socket_type constructors */
+static int socket_domain_table[] = { AF_UNIX, AF_INET, AF_INET6 };
+static int socket_type_table[] = { SOCK_STREAM, SOCK_DGRAM, SOCK_RAW, SOCK_SEQPACKET };
+
+static int
+table_index(int *table, int size, int x)
+{
+	for (int i = 0; i < size; i++)
+		if (table[i] == x)
+			return i;
+	return -1;
+}
+
+static int ai_flag_table[] = { AI_NUMERICHOST, AI_CANONNAME, AI_PASSIVE };
+
+/* family and socktype are indexes in the tables above or -1, flags is
+   a list of indexes in ai_flag_table */
+value
+stub_blocking_getaddrinfo(value node, value serv, value family,
+			  value socktype, value protocol, value flags)
+{
+	CAMLparam5(node, serv, family, socktype, protocol);
+	CAMLxparam1(flags);
+	CAMLlocal4(list, cell, ai, addr);
+	fiber_thread_init();
+	struct blocking_job job = {
+		.path = caml_string_length(node) ? strdup(String_val(node)) : NULL,
+		.serv = caml_string_length(serv) ? strdup(String_val(serv)) : NULL,
+		.hints = {
+			.ai_family = Int_val(family) < 0 ? AF_UNSPEC :
+				     socket_domain_table[Int_val(family)],
+			.ai_socktype = Int_val(socktype) < 0 ? 0 :
+				       socket_type_table[Int_val(socktype)],
+			.ai_protocol = Int_val(protocol),
+			.ai_flags = caml_convert_flag_list(flags, ai_flag_table),
+		},
+	};
+	if ((caml_string_length(node) && job.path == NULL) ||
+	    (caml_string_length(serv) && job.serv == NULL))
+		caml_raise_out_of_memory();
+	blocking_call(&job, job_getaddrinfo);
+	free(job.path);
+	free(job.serv);
+
+	/* like Unix.getaddrinfo, errors give an empty list */
+	list = Val_emptylist;
+	if (job.ret != 0)
+		CAMLreturn(list);
+	for (struct addrinfo *r = job.ai; r != NULL; r = r->ai_next) {
+		int fam = table_index(socket_domain_table, 3, r->ai_family),
+		    type = table_index(socket_type_table, 4, r->ai_socktype);
+		if (fam < 0 || type < 0 || r->ai_addrlen > sizeof(union sock_addr_union))
+			continue;
+		addr = alloc_sockaddr((union sock_addr_union *)r->ai_addr,
+				      r->ai_addrlen, -1);
+		ai = caml_alloc(5, 0);
+		Store_field(ai, 0, Val_int(fam));
+		Store_field(ai, 1, Val_int(type));
+		Store_field(ai, 2, Val_int(r->ai_protocol));
+		Store_field(ai, 3, addr);
+		Store_field(ai, 4, caml_copy_string(r->ai_canonname ?: ""));
+		cell = caml_alloc(2, 0);
+		Store_field(cell, 0, ai);
+		Store_field(cell, 1, list);
+		list = cell;
+	}
+	freeaddrinfo(job.ai);
+	CAMLreturn(list);
+}
+
+value
+stub_blocking_getaddrinfo_byte(value *argv, int argn __attribute__((unused)))
+{
+	return stub_blocking_getaddrinfo(argv[0], argv[1], argv[2],
+					 argv[3], argv[4], argv[5]);
+}
+
+/* Called with the runtime lock held, which serializes schedulers
+   registration. */
+static void
+fiber_thread_new(void)
+{
+	pthread_mutex_lock(&schedulers_free_mutex);
+	struct scheduler *s = schedulers_free;
+	if (s != NULL)
+		schedulers_free = s->next_free;
+	pthread_mutex_unlock(&schedulers_free_mutex);
+	int reused = s != NULL;
+
+	struct fiber *f = calloc(1, sizeof(struct fiber));
+	if (s == NULL && schedulers_used < 1U << FIBER_SCHED_BITS) {
+		s = calloc(1, sizeof(*s));
+		if (s != NULL) {
+			s->loop = schedulers_used == 0 ?
+				ev_default_loop(ev_recommended_backends() | EVFLAG_SIGNALFD) :
+				ev_loop_new(ev_recommended_backends() | EVFLAG_SIGNALFD);
+			if (s->loop == NULL) {
+				free(s);
+				s = NULL;
+			}
+		}
+		if (s != NULL) {
+			s->no = schedulers_used;
+			LIST_INIT(&s->fibers);
+			SLIST_INIT(&s->dirty_fibers);
+			pthread_mutex_init(&s->mutex, NULL);
+			fiber_ev_loop = s->loop;
+			ev_async_init(&s->wake_async, fiber_async);
+			ev_async_start(&s->wake_async);
+			if (schedulers_used == 0)
+				fiber_hooks_init();
+			schedulers_used++;
+		}
+	}
+	if (s == NULL || f == NULL) {
+		free(f);
+		if (s != NULL)
+			fiber_thread_free(s);
+		else if (schedulers_used == 1U << FIBER_SCHED_BITS)
+			caml_failwith("Fiber: too many threads");
+		caml_failwith("Fiber: can't create scheduler");
+	}
+	if (reused)
+		memcpy(stack_pools, s->stack_pools, sizeof(stack_pools));
+	fiber_segv_init();
+
+	for (int i = 0; i < FIBER_STACK_CLASSES; i++) {
+		SLIST_INIT(&zombie_fibers[0][i]);
+		SLIST_INIT(&zombie_fibers[1][i]);
+	}
+	for (int i = 0; i < FIBER_PRIORITIES; i++)
+		TAILQ_INIT(&wake_list[i]);
+	TAILQ_INIT(&untrimmed_zombies);
+
+	sched = f;
 	sched->id = 1;
+	if (fiber_slab_add(sched) < 0)
+		abort();
 	strcpy(sched->name, "sched");
 	sched->last_retaddr = 0xbeef;
 	sched_ctx = &sched->coro.ctx;
 
+	scheduler = s;
 	fiber = sched;
+	runtime_held = 1;
+	pthread_setspecific(scheduler_key, s);
 
-        ev_default_loop(ev_recommended_backends() | EVFLAG_SIGNALFD);
-
+	fiber_ev_loop = s->loop;
+	ev_set_loop_release_cb(s->loop, fiber_loop_release, fiber_loop_acquire);
 	ev_prepare_init(&wake_prep, (void *)fiber_wakeup_pending);
 	ev_set_priority(&wake_prep, -1);
 	ev_prepare_start(&wake_prep);
-	ev_async_init(&wake_async, fiber_async);
-        ev_async_start(&wake_async);
+	ev_idle_init(&wake_idle, fiber_idle);
+	ev_timer_init(&wheel.driver, wheel_cb, 0., 0.);
+	for (int i = 0; i < WHEEL_LEVELS; i++)
+		for (int j = 0; j < WHEEL_SIZE; j++)
+			TAILQ_INIT(&wheel.slot[i][j]);
+
+	pthread_mutex_lock(&s->mutex);
+	s->sched = sched;
+	pthread_mutex_unlock(&s->mutex);
+	fiber_mark_dirty(sched);
+	/* visible to GC and remote wakeups from now on */
+	__atomic_store_n(&schedulers[s->no], s, __ATOMIC_RELEASE);
+}
 
-	prev_scan_roots_hook = caml_scan_roots_hook;
-        prev_enter_blocking_section_hook = caml_enter_blocking_section_hook;
-        prev_leave_blocking_section_hook = caml_leave_blocking_section_hook;
-        prev_try_leave_blocking_section_hook = caml_try_leave_blocking_section_hook;
-        prev_stack_usage_hook = caml_stack_usage_hook;
+/* Thread exit, runs without the runtime lock. A scheduler with no
+   live fibers is put aside for the next thread which uses fibers: its
+   number, loop with watchers of registered descriptors, and stack
+   chunks are reused. Zombies and the fiber slab are freed, generations
+   of the next owner's fibers start above the ones used here, so stale
+   ids stay rejected. A suspended fiber may still be referenced by the
+   loop, by a blocking job or by io_uring, so a thread which exits
+   with such fibers keeps its scheduler, and its number, for the
+   process lifetime. */
+static void
+fiber_thread_free(void *arg)
+{
+	struct scheduler *s = arg;
+	if (!LIST_EMPTY(&s->fibers))
+		return;
+
+	if (scheduler == s) {
+		ev_prepare_stop(&wake_prep);
+		ev_idle_stop(&wake_idle);
+		ev_timer_stop(&wheel.driver);
+		uring_free();
+		ev_set_loop_release_cb(s->loop, NULL, NULL);
+	}
+	__atomic_store_n(&schedulers[s->no], NULL, __ATOMIC_RELEASE);
+	/* GC of other threads may have got s before it was unlinked */
+	pthread_mutex_lock(&s->mutex);
+	SLIST_INIT(&s->dirty_fibers);
+	s->sched = NULL;
+	s->stack_usage = 0;
+	pthread_mutex_unlock(&s->mutex);
+
+	if (scheduler == s) {
+		for (unsigned i = 1; i < fiber_slab_used; i++) {
+			struct fiber *f = fiber_slab[i];
+			if (((f->gen - s->gen) & FIBER_GEN_MASK) < FIBER_GEN_MASK / 2)
+				s->gen = f->gen;
+			stack_pool_free(f->stack_guard, f->stack_class, f->coro.mmap);
+			free(f);
+		}
+		free(sched);
+		free(fiber_slab);
+		fiber_slab = NULL;
+		fiber_slab_used = fiber_slab_size = 0;
+		free(stack_profile);
+		stack_profile = NULL;
+		stack_profile_used = stack_profile_size = 0;
+		memcpy(s->stack_pools, stack_pools, sizeof(stack_pools));
+		memset(stack_pools, 0, sizeof(stack_pools));
+		zombie_stat.count = zombie_stat.trimmed = 0;
+		zombie_stat.untrimmed_bytes = 0;
+		scheduler = NULL;
+		fiber = sched = NULL;
+		sched_ctx = NULL;
+		fiber_ev_loop = NULL;
+
+		stack_t ss = { .ss_flags = SS_DISABLE };
+		if (segv_altstack != NULL && sigaltstack(&ss, NULL) == 0) {
+			free(segv_altstack);
+			segv_altstack = NULL;
+		}
+	}
 
-        caml_scan_roots_hook = fiber_all_scan_roots;
-	caml_enter_blocking_section_hook = fiber_enter_blocking_section;
-	caml_leave_blocking_section_hook = fiber_leave_blocking_section;
-	caml_try_leave_blocking_section_hook = fiber_try_leave_blocking_section;
-	caml_stack_usage_hook = fiber_stack_usage;
+	pthread_mutex_lock(&schedulers_free_mutex);
+	s->next_free = schedulers_free;
+	schedulers_free = s;
+	pthread_mutex_unlock(&schedulers_free_mutex);
+}
+
+__attribute__((constructor))
+static void
+fiber_init(void)
+{
+	page_size = sysconf(_SC_PAGESIZE);
+	pthread_key_create(&scheduler_key, fiber_thread_free);
+}
+
+#else
+
+/* OCaml 5 has none of the runtime hooks used above (scan_roots,
+   blocking section hooks, caml_bottom_of_stack), fibers are
+   implemented with effect handlers in fiber.ocaml5.ml. Only the
+   clock cache, poll(2) and send(2) without SIGPIPE are left in C. */
+
+static __thread double now_cache;
+static __thread int now_cached;
+
+static double
+clock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* called by the loop of the current domain after every poll */
+value
+stub_update_now(value unit __attribute__((unused)))
+{
+	now_cache = clock_now();
+	now_cached = 1;
+	return Val_unit;
+}
+
+double
+stub_now(value unit __attribute__((unused)))
+{
+	return now_cached ? now_cache : clock_now();
+}
+
+value
+stub_now_byte(value unit)
+{
+	return caml_copy_double(stub_now(unit));
+}
+
+/* Polls [n] descriptors of [fds] for events of [events] (1 is READ,
+   2 is WRITE), which are replaced by ready ones. Error and hangup make
+   all requested events ready, the waiter gets the error from its
+   syscall. Returns the number of ready descriptors, 0 if interrupted.
+   Arrays may be moved by GC while the runtime lock is released: the
+   request is copied into pfd before, results are stored after. */
+value
+stub_poll(value fds, value events, value n, value timeout)
+{
+	CAMLparam4(fds, events, n, timeout);
+	static __thread struct pollfd *pfd;
+	static __thread int pfd_size;
+	int count = Int_val(n);
+	double t = Double_val(timeout);
+
+	if (count > pfd_size) {
+		struct pollfd *p = realloc(pfd, count * sizeof(*p));
+		if (p == NULL)
+			caml_raise_out_of_memory();
+		pfd = p;
+		pfd_size = count;
+	}
+	for (int i = 0; i < count; i++) {
+		int ev = Int_val(Field(events, i));
+		pfd[i].fd = Int_val(Field(fds, i));
+		pfd[i].events = (ev & 1 ? POLLIN : 0) | (ev & 2 ? POLLOUT : 0);
+		pfd[i].revents = 0;
+	}
+	/* rounded up, the timer must be expired when poll returns */
+	int ms = t < 0 ? -1 : t * 1e3 >= INT_MAX ? INT_MAX : (int)ceil(t * 1e3);
+
+	caml_enter_blocking_section();
+	int r = poll(pfd, count, ms);
+	int saved_errno = errno;
+	caml_leave_blocking_section();
+	if (r < 0) {
+		if (saved_errno != EINTR) {
+			errno = saved_errno;
+			caml_uerror("poll", Nothing);
+		}
+		r = 0;
+	}
+
+	for (int i = 0; i < count; i++) {
+		int re = pfd[i].revents;
+		if (re & (POLLERR | POLLHUP | POLLNVAL))
+			re |= POLLIN | POLLOUT;
+		re &= pfd[i].events;
+		Store_field(events, i, Val_int((re & POLLIN ? 1 : 0) |
+					       (re & POLLOUT ? 2 : 0)));
+	}
+	CAMLreturn(Val_int(r));
 }
+
+static int msg_flag_table[] = { MSG_OOB, MSG_DONTROUTE, MSG_PEEK };
+
+/* single non-blocking send(2), the fiber waits in OCaml */
+value
+stub_send_nosignal(value fd, value buf, value ofs, value len, value flags)
+{
+	int cflags = caml_convert_flag_list(flags, msg_flag_table) | MSG_NOSIGNAL;
+	ssize_t n;
+	do
+		n = send(Int_val(fd), &Byte(buf, Long_val(ofs)), Long_val(len),
+			 cflags);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		caml_uerror("send", Nothing);
+	return Val_long(n);
+}
+
+#endif
@@ -0,0 +1,132 @@
+(*
+ * Copyright (C) 2018 Yuriy Vostrikov
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *)
+
+(* Mutex, Condition and MVar are built on queues of suspended fibers
+   only, so both backends instantiate them from here. *)
+
+module type FQUEUE = sig
+  type fqueue
+  val create : unit -> fqueue
+  val yield : fqueue -> unit (* suspends the current fiber in the queue *)
+  val wake : fqueue -> unit (* wakes all fibers and empties the queue *)
+  val wake_one : fqueue -> unit
+end
+
+module Make (FQueue : FQUEUE) = struct
+  module Mutex = struct
+    type t = { mutable locked: bool;
+               waitq: FQueue.fqueue }
+
+    let create () = { locked = false;
+                      waitq = FQueue.create () }
+    let rec lock l =
+      match l.locked with
+        false -> l.locked <- true
+      | true -> FQueue.yield l.waitq;
+                lock l
+
+    let try_lock l =
+      match l.locked with
+        false -> l.locked <- true;
+                 true
+      | true -> false
+
+    let unlock l =
+      l.locked <- false;
+      FQueue.wake l.waitq
+
+    let with_lock l f =
+      try
+        lock l;
+        let r = f () in
+        unlock l;
+        r
+      with e ->
+        unlock l;
+        raise e
+
+    let is_locked l = l.locked
+  end
+
+  module Condition = struct
+    type t = FQueue.fqueue
+
+    let create () = FQueue.create ()
+
+    let wait ?mutex c =
+      let option_iter f = function Some v -> f v
+                                 | None -> () in
+      option_iter Mutex.unlock mutex;
+      FQueue.yield c;
+      option_iter Mutex.lock mutex
+
+    let signal c =
+      FQueue.wake_one c
+
+    let broadcast c =
+      FQueue.wake c
+  end
+
+  module MVar = struct
+    type 'a t = { mutable value : 'a option;
+                  mutable put_wait : FQueue.fqueue;
+                  mutable take_wait : FQueue.fqueue }
+
+    let make value = { value;
+                       put_wait = FQueue.create ();
+                       take_wait = FQueue.create (); }
+
+    let create value = make (Some value)
+    let create_empty () = make None
+
+    let rec put v value =
+      match v.value with
+        None ->
+         v.value <- Some value;
+         FQueue.wake v.take_wait
+      | Some _ ->
+         FQueue.yield v.put_wait;
+         put v value
+
+    let rec take v =
+      match v.value with
+        Some value ->
+         v.value <- None;
+         FQueue.wake v.put_wait;
+         value
+      | None ->
+         FQueue.yield v.take_wait;
+         take v
+
+    let take_available ({value; _} as v) =
+      if value <> None then begin
+        v.value <- None;
+        FQueue.wake v.put_wait;
+      end;
+      value
+
+    let is_empty v = v.value == None
+  end
+end
@@ -0,0 +1 @@
+external recurse : int -> int = "overflow_recurse"
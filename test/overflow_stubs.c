@@ -0,0 +1,12 @@
+#include <caml/mlvalues.h>
+
+/* about 1K of C stack per level, not a tail call */
+value
+overflow_recurse(value n)
+{
+	volatile char buf[1024];
+	buf[0] = (char)Int_val(n);
+	if (Int_val(n) == 0)
+		return Val_int(buf[0]);
+	return Val_int(Int_val(overflow_recurse(Val_int(Int_val(n) - 1))) + buf[0]);
+}
@@ -0,0 +1,25 @@
+(* values on stacks of parked fibers must survive minor collections,
+   no matter if a fiber was running since the last one or not *)
+let n = 1000
+
+let main i =
+  let l = List.init 10 (fun j -> string_of_int (i + j)) in
+  Fiber.yield ();
+  let l' = List.map (fun s -> s ^ "0") l in
+  Fiber.yield ();
+  List.fold_left (fun a s -> a + int_of_string s) 0 (l @ l')
+
+let _ =
+  let fs = Array.init n (Fiber.create main) in
+  let odd i = i mod 2 = 1 in
+  Array.iter Fiber.resume fs;
+  Gc.minor ();
+  Array.iteri (fun i f -> if odd i then Fiber.resume f) fs;
+  Gc.minor ();
+  Array.iter Fiber.resume fs;
+  Gc.minor ();
+  Gc.full_major ();
+  Array.iteri (fun i f -> if not (odd i) then Fiber.resume f) fs;
+  Gc.minor ();
+  Array.fold_left (fun a f -> a + Fiber.join f) 0 fs |> print_int;
+  print_newline ()
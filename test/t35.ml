@@ -0,0 +1,15 @@
+(* suspended fibers are accounted in Gc.stack_size, dead ones are not *)
+let rec deep n =
+  if n = 0 then (Fiber.yield (); 0)
+  else 1 + deep (n - 1)
+
+let stack_size () = (Gc.stat ()).Gc.stack_size
+
+let _ =
+  let base = stack_size () in
+  let fs = Array.init 100 (fun _ -> Fiber.create deep 1000) in
+  Array.iter Fiber.resume fs;
+  assert (stack_size () - base >= 100 * 1000);
+  Array.iter Fiber.resume fs;
+  Array.iter (fun f -> assert (Fiber.join f = 1000)) fs;
+  assert (stack_size () - base < 1000)
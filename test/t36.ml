@@ -0,0 +1,14 @@
+let rec sum n = if n = 0 then 0 else n + sum (n - 1)
+
+let _ =
+  let small = Fiber.create ~stack_size:16384 sum 100 in
+  let large = Fiber.create ~stack_size:(64 * 1024 * 1024) sum 1_000_000 in
+  Fiber.resume small;
+  Fiber.resume large;
+  Printf.printf "%d %d\n" (Fiber.join small) (Fiber.join large);
+  (* dead contexts are reused only by fibers of the same stack size *)
+  let small' = Fiber.create ~stack_size:10000 sum 10 in
+  Fiber.resume small';
+  Printf.printf "%d\n" (Fiber.join small');
+  try Fiber.create ~stack_size:(-1) ignore () |> ignore
+  with Invalid_argument _ as e -> print_endline (Printexc.to_string e)
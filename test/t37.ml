@@ -0,0 +1,12 @@
+(* more fibers than vm.max_map_count would allow with guard zones *)
+let n = 40_000
+
+let _ =
+  let fs = Array.init n (fun i ->
+               Fiber.create ~stack_size:16384 ~guard:false (fun () ->
+                   Fiber.yield ();
+                   i) ()) in
+  Array.iter Fiber.resume fs;
+  Array.iter Fiber.resume fs;
+  Array.fold_left (fun a f -> a + Fiber.join f) 0 fs |> print_int;
+  print_newline ()
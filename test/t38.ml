@@ -0,0 +1,23 @@
+let rec deep n = if n = 0 then 0 else 1 + deep (n - 1)
+
+let print_stats () =
+  let s = Fiber.zombie_stats () in
+  Printf.printf "%d %d\n" s.Fiber.zombies s.Fiber.trimmed
+
+let spawn n =
+  let fs = Array.init n (fun _ -> Fiber.create deep 5000) in
+  Array.iter Fiber.resume fs
+
+let _ =
+  spawn 100;
+  print_stats ();
+  Fiber.trim ();
+  print_stats ();
+  assert ((Fiber.zombie_stats ()).Fiber.reclaimed_bytes >= 100 * 32768);
+  Fiber.set_zombie_limits ~count:10 ();
+  spawn 20;
+  print_stats ();
+  (* a dying fiber doesn't trim its own stack, the next one does *)
+  Fiber.set_zombie_limits ~count:0 ();
+  spawn 20;
+  print_stats ()
@@ -0,0 +1,12 @@
+let rec deep n = 1 + deep (n + 1)
+
+let _ =
+  let f = Fiber.create ~stack_size:16384 (fun () ->
+              try deep 0 with Stack_overflow -> -1) () in
+  Fiber.resume f;
+  print_int (Fiber.join f);
+  print_newline ();
+  (* fiber context is reusable after overflow *)
+  let g = Fiber.create ~stack_size:16384 (fun () -> "ok") () in
+  Fiber.resume g;
+  print_endline (Fiber.join g)
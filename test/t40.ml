@@ -0,0 +1,28 @@
+let rec deep n = if n = 0 then 0 else 1 + deep (n - 1)
+
+let spawn name n depth =
+  let fs = Array.init n (fun _ -> Fiber.create ~name deep depth) in
+  Array.iter Fiber.resume fs
+
+let find name =
+  List.find (fun p -> p.Fiber.name = name) (Fiber.stack_profile ())
+
+let _ =
+  Fiber.set_stack_profiling true;
+  spawn "shallow" 10 10;
+  spawn "deep" 10 10000;
+  (* reused stacks must be measured again *)
+  spawn "shallow" 10 10;
+  spawn "deep" 10 10000;
+  let s = find "shallow" and d = find "deep" in
+  Printf.printf "%d %d\n" s.Fiber.samples d.Fiber.samples;
+  assert (s.Fiber.max_depth < 16384);
+  assert (d.Fiber.max_depth > 10000 * 2 * Sys.word_size / 8);
+  assert (Fiber.stack_percentile d 0.99 >= d.Fiber.max_depth);
+  assert (Fiber.stack_percentile s 0.5 < Fiber.stack_percentile d 0.5);
+  Fiber.set_stack_profiling false;
+  spawn "off" 10 10;
+  Printf.printf "%b\n" (List.exists (fun p -> p.Fiber.name = "off")
+                          (Fiber.stack_profile ()));
+  Fiber.set_stack_profiling true;
+  print_int (List.length (Fiber.stack_profile ()))
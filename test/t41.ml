@@ -0,0 +1,21 @@
+(* ring of fibers passing a counter with transfer *)
+let n = 3
+let fibers = Array.make n (Obj.magic 0)
+
+let stage i () =
+  let rec pass v =
+    Printf.printf "%d:%d " i v;
+    if v < 9 then
+      pass (Fiber.unsafe_transfer fibers.((i + 1) mod n) (v + 1))
+  in
+  pass (Fiber.unsafe_yield ())
+
+let _ =
+  for i = 0 to n - 1 do
+    fibers.(i) <- Fiber.create (stage i) ();
+    Fiber.resume fibers.(i)
+  done;
+  (* the last stage returns to the main context which resumed the first *)
+  Fiber.unsafe_resume fibers.(0) 0;
+  print_newline ();
+  try Fiber.transfer fibers.(1) with Invalid_argument s -> print_string s
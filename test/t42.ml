@@ -0,0 +1,29 @@
+(* ready fibers run back to back, the timer fires only after they finish *)
+let pings = ref 0
+
+let ping_pong n =
+  let a = Fiber.MVar.create_empty () and b = Fiber.MVar.create_empty () in
+  let _ = Fiber.create (fun () ->
+              for _ = 1 to n do
+                Fiber.MVar.take a;
+                Fiber.MVar.put b ()
+              done) () |> Fiber.wake in
+  for _ = 1 to n do
+    Fiber.MVar.put a ();
+    Fiber.MVar.take b;
+    incr pings
+  done
+
+let main () =
+  let t = Fiber.create (fun () -> Fiber.sleep 0.; !pings) () in
+  Fiber.wake t;
+  ping_pong 1000;
+  Fiber.join t
+
+let _ =
+  (try Fiber.set_run_budget ~rounds:0 ()
+   with Invalid_argument s -> print_endline s);
+  Fiber.set_run_budget ~time:10. ();
+  match Fiber.run main () with
+    Some n -> print_int n
+  | None -> ()
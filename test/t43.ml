@@ -0,0 +1,35 @@
+let log = ref []
+
+let spawn priority tag =
+  let f = Fiber.create ~priority (fun () -> log := tag :: !log) () in
+  Fiber.wake f;
+  f
+
+let pos tag =
+  let rec loop i = function
+      t :: _ when t = tag -> i
+    | _ :: tl -> loop (i + 1) tl
+    | [] -> -1 in
+  loop 0 (List.rev !log)
+
+let main () =
+  let fs = [spawn Fiber.Background "background"; spawn Fiber.Low "low";
+            spawn Fiber.Normal "normal"; spawn Fiber.High "high"] in
+  List.iter Fiber.join fs;
+  print_endline (String.concat " " (List.rev !log));
+
+  log := [];
+  let f = spawn Fiber.High "changed" in
+  Fiber.set_priority f Fiber.Low;
+  let fs = f :: List.init 5 (fun _ -> spawn Fiber.Normal "") in
+  List.iter Fiber.join fs;
+  Printf.printf "%d\n" (pos "changed");
+
+  (* background fiber is resumed after at most 128 high ones *)
+  log := [];
+  let fs = spawn Fiber.Background "bg" ::
+             List.init 200 (fun _ -> spawn Fiber.High "") in
+  List.iter Fiber.join fs;
+  print_int (pos "bg")
+
+let _ = Fiber.run main ()
@@ -0,0 +1,31 @@
+let main () =
+  let open Unix in
+  let a, b = socketpair PF_UNIX SOCK_STREAM 0 in
+  set_nonblock a;
+  let fa = Fiber.Fd.register a in
+  assert (Fiber.Fd.descr fa = a);
+  let n = 100 in
+  let reader = Fiber.create (fun () ->
+      let buf = Bytes.create 1 and sum = ref 0 in
+      while !sum < n * (n + 1) / 2 do
+        match read a buf 0 1 with
+          1 -> sum := !sum + Char.code (Bytes.get buf 0)
+        | _ -> assert false
+        | exception Unix_error (EAGAIN, _, _) -> Fiber.Fd.wait fa Fiber.READ
+      done;
+      !sum) () in
+  Fiber.wake reader;
+  for i = 1 to n do
+    ignore (single_write b (Bytes.make 1 (Char.chr i)) 0 1);
+    Fiber.sleep 0.
+  done;
+  Printf.printf "%d\n" (Fiber.join reader);
+
+  let waiter = Fiber.create (fun () -> Fiber.Fd.wait fa Fiber.READ) () in
+  Fiber.resume waiter;
+  (try Fiber.Fd.wait fa Fiber.READ with Invalid_argument s -> print_endline s);
+  Fiber.Fd.unregister fa;
+  Fiber.join waiter;
+  print_string "unregistered"
+
+let _ = Fiber.run main ()
@@ -0,0 +1,38 @@
+let main () =
+  let open Unix in
+  let l = socket PF_INET SOCK_STREAM 0 in
+  setsockopt l SO_REUSEADDR true;
+  bind l (ADDR_INET (inet_addr_loopback, 0));
+  listen l 8;
+  let addr = getsockname l in
+  let fl = Fiber.Fd.register l in
+  let server = Fiber.create (fun () ->
+      let c, _ = Fiber.Fd.accept fl in
+      let fc = Fiber.Fd.register c in
+      let buf = Bytes.create 16 in
+      let rec echo () =
+        match Fiber.Fd.read fc buf 0 16 with
+          0 -> ()
+        | n -> ignore (Fiber.Fd.write fc buf 0 n); echo ()
+      in
+      echo ();
+      Fiber.Fd.unregister fc;
+      close c) () in
+  Fiber.wake server;
+  let c = socket PF_INET SOCK_STREAM 0 in
+  connect c addr;
+  let fc = Fiber.Fd.register c in
+  let buf = Bytes.of_string "hello, world" in
+  ignore (Fiber.Fd.send fc buf 0 5 []);
+  let n = Fiber.Fd.recv fc buf 0 12 [] in
+  print_endline (Bytes.sub_string buf 0 n);
+  (try ignore (Fiber.Fd.read fc buf 10 5) with Invalid_argument s -> print_endline s);
+  shutdown c SHUTDOWN_SEND;
+  Fiber.join server;
+  print_int (Fiber.Fd.read fc buf 0 12)
+
+let _ =
+  let a, _ = Unix.socketpair Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  (try ignore (Fiber.Fd.read (Fiber.Fd.register a) (Bytes.create 1) 0 1)
+   with Unix.Unix_error (Unix.EAGAIN, "read", _) -> print_endline "EAGAIN");
+  Fiber.run main ()
@@ -0,0 +1,14 @@
+let main () =
+  let open Unix in
+  let a, b = socketpair PF_UNIX SOCK_STREAM 0 in
+  (try Fiber.wait_io_ready ~timeout:0.01 a Fiber.READ
+   with Fiber.Timeout -> print_endline "timeout");
+  Fiber.wait_io_ready ~timeout:1. a Fiber.WRITE;
+  assert (Fiber.wait_any ~timeout:0.01 [(a, Fiber.READ); (b, Fiber.READ)] = None);
+  ignore (write_substring a "x" 0 1);
+  (match Fiber.wait_any ~timeout:1. [(a, Fiber.READ); (b, Fiber.READ)] with
+     Some (fd, Fiber.READ) when fd = b -> print_endline "b"
+   | _ -> print_endline "unexpected");
+  print_endline "ok"
+
+let _ = Fiber.run main ()
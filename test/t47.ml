@@ -0,0 +1,26 @@
+let show = function
+    Fiber.READ -> "read"
+  | Fiber.WRITE -> "write"
+  | Fiber.READ_WRITE -> "read_write"
+
+let main () =
+  let open Unix in
+  let a, b = socketpair PF_UNIX SOCK_STREAM 0 in
+  print_endline (show (Fiber.wait_io a Fiber.READ_WRITE));
+  ignore (write_substring b "x" 0 1);
+  print_endline (show (Fiber.wait_io a Fiber.READ_WRITE));
+  print_endline (show (Fiber.wait_io a Fiber.READ));
+
+  let fa = Fiber.Fd.register a in
+  print_endline (show (Fiber.Fd.wait_io fa Fiber.READ_WRITE));
+  let c, d = socketpair PF_UNIX SOCK_STREAM 0 in
+  let fc = Fiber.Fd.register c in
+  let f = Fiber.create (fun () -> print_endline (show (Fiber.Fd.wait_io fc Fiber.READ))) () in
+  Fiber.resume f;
+  ignore (write_substring d "x" 0 1);
+  Fiber.join f;
+  match Fiber.wait_any [(a, Fiber.READ_WRITE); (d, Fiber.READ)] with
+    Some (fd, ev) when fd = a -> print_endline (show ev)
+  | _ -> print_endline "unexpected"
+
+let _ = Fiber.run main ()
@@ -0,0 +1,23 @@
+let log = ref []
+
+let sleeper t =
+  Fiber.sleep t;
+  log := t :: !log
+
+let main () =
+  let fs = List.map (fun t -> Fiber.create sleeper t)
+             [0.3; 0.1; 0.; 0.05; 0.6] in
+  List.iter Fiber.wake fs;
+  Fiber.sleep 0.01;
+  (try Fiber.set_timer_resolution 0.1 with Invalid_argument s -> print_endline s);
+  List.iter Fiber.join fs;
+  List.rev !log |> List.iter (Printf.printf "%g ");
+  print_newline ();
+  let a, _ = Unix.socketpair Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  (try Fiber.wait_io_ready ~timeout:0.02 a Fiber.READ
+   with Fiber.Timeout -> print_endline "timeout")
+
+let _ =
+  Fiber.set_timer_resolution 0.01;
+  ignore (Fiber.run main ());
+  Fiber.set_timer_resolution 0.
@@ -0,0 +1,27 @@
+(* sleepers with deadlines spread over 20ms are woken in one iteration *)
+let ticks = ref 0
+let stop = ref false
+
+let rec ticker () =
+  if not !stop then begin
+    Fiber.sleep ~slack:0. 0.001;
+    incr ticks;
+    ticker ()
+  end
+
+let main () =
+  let t = Fiber.create ticker () in
+  Fiber.wake t;
+  let seen = Hashtbl.create 8 in
+  let fs = List.init 20 (fun i ->
+               Fiber.create (fun () ->
+                   Fiber.sleep ~slack:0.5 (0.001 *. float i);
+                   Hashtbl.replace seen !ticks ()) ()) in
+  List.iter Fiber.wake fs;
+  List.iter Fiber.join fs;
+  stop := true;
+  Fiber.join t;
+  print_int (Hashtbl.length seen);
+  (try Fiber.set_timer_slack (-1.) with Invalid_argument s -> print_string (" " ^ s))
+
+let _ = Fiber.run main ()
@@ -0,0 +1,12 @@
+let main () =
+  let start = Fiber.now () in
+  for i = 1 to 10 do
+    Fiber.sleep_until (start +. 0.01 *. float i)
+  done;
+  let elapsed = Fiber.now () -. start in
+  assert (elapsed >= 0.099 && elapsed < 0.2);
+  (* deadline in the past returns on the next iteration *)
+  Fiber.sleep_until (start -. 1.);
+  print_string "ok"
+
+let _ = Fiber.run main ()
@@ -0,0 +1,29 @@
+let main () =
+  let name = Filename.temp_file "fiber" "t51" in
+  (* other fibers keep running while a call is executed by the pool *)
+  let ticks = ref 0 in
+  let ticker = Fiber.create (fun () ->
+      for _ = 1 to 3 do Fiber.sleep 0.001; incr ticks done) () in
+  Fiber.wake ticker;
+  let fd = Fiber.Blocking.openfile name [Unix.O_WRONLY; Unix.O_TRUNC] 0o644 in
+  let n = Fiber.Blocking.write fd (Bytes.of_string "hello, world") 0 12 in
+  Fiber.Blocking.fsync fd;
+  Unix.close fd;
+  let st = Fiber.Blocking.stat name in
+  Printf.printf "%d %d %b\n" n st.Unix.st_size (st.Unix.st_kind = Unix.S_REG);
+  let fd = Fiber.Blocking.openfile name [Unix.O_RDONLY] 0 in
+  let buf = Bytes.create 16 in
+  let n = Fiber.Blocking.read fd buf 2 5 in
+  Unix.close fd;
+  print_endline (Bytes.sub_string buf 2 n);
+  (try ignore (Fiber.Blocking.stat (name ^ ".missing"))
+   with Unix.Unix_error (Unix.ENOENT, "stat", _) -> print_endline "ENOENT");
+  (match Fiber.Blocking.getaddrinfo "127.0.0.1" "80"
+           [Unix.AI_NUMERICHOST; Unix.AI_SOCKTYPE Unix.SOCK_STREAM] with
+     {Unix.ai_addr = Unix.ADDR_INET (a, 80); _} :: _ ->
+      print_endline (Unix.string_of_inet_addr a)
+   | _ -> print_endline "unexpected");
+  Fiber.join ticker;
+  Sys.remove name
+
+let _ = Fiber.run main ()
@@ -0,0 +1,35 @@
+let size = 1 lsl 20
+
+let main () =
+  let a, b = Unix.socketpair Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  let fa = Fiber.Fd.register a and fb = Fiber.Fd.register b in
+  let reader = Fiber.create (fun () ->
+      let buf = Bytes.create 4096 in
+      let rec loop total sum =
+        match Fiber.Fd.read fb buf 0 4096 with
+          0 -> total, sum
+        | n ->
+          let sum = ref sum in
+          for i = 0 to n - 1 do
+            sum := (!sum * 31 + Char.code (Bytes.get buf i)) land 0xffffff
+          done;
+          loop (total + n) !sum
+      in
+      loop 0 0) () in
+  Fiber.wake reader;
+  let data = Bytes.init size (fun i -> Char.chr (i land 0xff)) in
+  print_int (Fiber.Fd.write fa data 0 size);
+  print_newline ();
+  Unix.shutdown a Unix.SHUTDOWN_SEND;
+  let total, sum = Fiber.join reader in
+  Printf.printf "%d %d\n" total sum;
+  Fiber.Fd.unregister fa;
+  Fiber.Fd.unregister fb;
+  Unix.close a;
+  Unix.close b
+
+let _ =
+  (try ignore (Fiber.Fd.use_uring ~entries:0 ())
+   with Invalid_argument s -> print_endline s);
+  ignore (Fiber.Fd.use_uring ());
+  Fiber.run main ()
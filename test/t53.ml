@@ -0,0 +1,24 @@
+let main () =
+  let fibers = List.init 4 (fun i ->
+      Fiber.create (fun () -> Fiber.yield (); print_int i) ()) in
+  List.iter Fiber.wake fibers;
+  Fiber.sleep 0.001;
+  (* requests are delivered in order, dead fibers are skipped *)
+  let dead = Fiber.create ignore () in
+  Fiber.wake dead;
+  Fiber.join dead;
+  List.iter Fiber.wake_remote (List.rev fibers);
+  Fiber.wake_remote dead;
+  List.iter Fiber.join fibers;
+  print_newline ();
+  (* a burst of requests for the same fiber wakes it once *)
+  let count = ref 0 in
+  let f = Fiber.create (fun () ->
+      while true do Fiber.yield (); incr count done) () in
+  Fiber.wake f;
+  Fiber.sleep 0.001;
+  for _ = 1 to 1000 do Fiber.wake_remote f done;
+  Fiber.sleep 0.001;
+  print_int !count
+
+let _ = Fiber.run main ()
@@ -0,0 +1,65 @@
+let work () =
+  let acc = ref [] in
+  let fibers = List.init 10 (fun i ->
+      Fiber.create (fun () ->
+          for j = 1 to 100 do
+            acc := (i * j) :: !acc;
+            if j mod 10 = 0 then Gc.minor ();
+            Fiber.sleep 0.
+          done) ()) in
+  List.iter Fiber.wake fibers;
+  List.iter Fiber.join fibers;
+  Gc.full_major ();
+  List.fold_left (+) 0 !acc
+
+(* A fiber preempted by the tick thread while another thread runs a
+   minor GC keeps running afterwards and puts young values on its
+   stack, the next minor GC must scan it. *)
+let preempted () =
+  let ok = ref true in
+  for round = 1 to 10 do
+    let stop = Unix.gettimeofday () +. 0.06 in
+    while Unix.gettimeofday () < stop do
+      ignore (Sys.opaque_identity (ref round))
+    done;
+    let l = List.init 1000 (fun i -> [i + round]) in
+    Fiber.sleep 0.002;
+    List.iteri (fun i x -> if x <> [i + round] then ok := false) l
+  done;
+  !ok
+
+let published = ref None
+
+let waiter () =
+  let me = Fiber.create (fun () -> Fiber.yield (); "woken") () in
+  Fiber.wake me;
+  Fiber.sleep 0.001;
+  published := Some me;
+  Fiber.join me
+
+let _ =
+  let results = Array.make 2 0 in
+  let threads = List.init 2 (fun i ->
+      Thread.create (fun () -> results.(i) <- Fiber.run work ()) ()) in
+  let woken = ref "" in
+  let t = Thread.create (fun () -> woken := Fiber.run waiter ()) () in
+  let here = Fiber.run work () in
+  let rec wait () =
+    match !published with
+      Some f -> f
+    | None -> Thread.yield (); wait ()
+  in
+  let f = wait () in
+  let gc = ref true in
+  let collector = Thread.create (fun () ->
+      while !gc do Gc.minor (); Thread.delay 0.0005 done) () in
+  let p = Thread.create (fun () ->
+      print_endline (if Fiber.run preempted () = Some true
+                     then "preempted ok" else "preempted corrupted")) () in
+  Thread.join p;
+  gc := false;
+  Thread.join collector;
+  (try Fiber.wake f with Invalid_argument s -> print_endline s);
+  Fiber.wake_remote f;
+  List.iter Thread.join (t :: threads);
+  Printf.printf "%d %d %d\n%s\n" here results.(0) results.(1) !woken
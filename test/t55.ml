@@ -0,0 +1,32 @@
+let main () =
+  let a, b = Unix.socketpair Unix.PF_UNIX Unix.SOCK_STREAM 0 in
+  (* expired deadline times out instead of waiting forever *)
+  let start = Fiber.now () in
+  (try Fiber.wait_io_ready ~timeout:(start -. 1. -. Fiber.now ()) a Fiber.READ
+   with Fiber.Timeout -> print_endline "timeout");
+  print_endline (match Fiber.wait_any ~timeout:(-0.5) [a, Fiber.READ] with
+                   None -> "none"
+                 | Some _ -> "ready");
+  (* wake ends the wait early but doesn't look like a timeout *)
+  let w = Fiber.create (fun () ->
+              let t = Fiber.now () in
+              let r = match Fiber.wait_io ~timeout:1. a Fiber.READ with
+                  Fiber.READ -> "woken"
+                | _ -> "other"
+                | exception Fiber.Timeout -> "timeout" in
+              r, Fiber.now () -. t < 0.5) () in
+  Fiber.wake w;
+  (match Fiber.join w with
+     r, true -> print_endline r
+   | _, false -> print_endline "late");
+  let w = Fiber.create (fun () ->
+              match Fiber.wait_any [a, Fiber.READ] with
+                None -> "woken"
+              | Some _ -> "ready") () in
+  Fiber.wake w;
+  print_endline (Fiber.join w);
+  ignore (Unix.write_substring b "x" 0 1);
+  Fiber.wait_io_ready a Fiber.READ;
+  print_endline "read"
+
+let _ = Fiber.run main ()
@@ -0,0 +1,16 @@
+(* sleep loop on the timing wheel: the driver is restarted from the
+   fiber resumed by the last timer of a tick *)
+let main () =
+  Fiber.set_timer_resolution 0.005;
+  let start = Unix.gettimeofday () in
+  for _ = 1 to 20 do
+    Fiber.sleep 0.01
+  done;
+  let elapsed = Unix.gettimeofday () -. start in
+  print_endline (if elapsed >= 0.2 && elapsed < 2. then "ok" else "bad");
+  (* wheel is empty again, resolution can be changed *)
+  Fiber.set_timer_resolution 0.;
+  Fiber.sleep 0.01;
+  print_endline "done"
+
+let _ = Fiber.run main ()
@@ -0,0 +1,42 @@
+(* Schedulers of exited threads are reused: more threads than there
+   are scheduler numbers can use fibers one after another, and ids of
+   fibers of an exited thread don't match fibers of the next one. *)
+let job i =
+  let f = Fiber.create (fun () -> Fiber.sleep 0.; i) () in
+  Fiber.wake f;
+  Fiber.join f
+
+let in_thread g =
+  let r = ref None in
+  let t = Thread.create (fun () -> r := Fiber.run g ()) () in
+  Thread.join t;
+  (* scheduler is released after the thread is joined *)
+  Thread.delay 0.01;
+  !r
+
+let _ =
+  let sum = ref 0 in
+  for i = 1 to 300 do
+    match in_thread (fun () -> job i) with
+    | Some v -> sum := !sum + v
+    | None -> ()
+  done;
+  Printf.printf "%d\n" !sum;
+
+  let stale = in_thread (fun () ->
+      let f = Fiber.create ignore () in
+      Fiber.wake f;
+      Fiber.join f;
+      f) in
+  let woken = in_thread (fun () ->
+      let woken = ref false in
+      let g = Fiber.create (fun () -> Fiber.yield (); woken := true) () in
+      Fiber.wake g;
+      Fiber.sleep 0.001;
+      (match stale with Some f -> Fiber.wake_remote f | None -> ());
+      Fiber.sleep 0.01;
+      let v = !woken in
+      Fiber.wake g;
+      Fiber.join g;
+      v) in
+  print_endline (if woken = Some false then "stale id ignored" else "stale id woke")
@@ -0,0 +1,41 @@
+(* every domain runs its own loop, fibers of different domains wake
+   each other with wake_remote only *)
+let work i =
+  let acc = ref 0 in
+  let fibers = List.init 10 (fun j ->
+      Fiber.create (fun () ->
+          for k = 1 to 100 do
+            acc := !acc + i * j * k;
+            Fiber.sleep 0.
+          done) ()) in
+  List.iter Fiber.wake fibers;
+  List.iter Fiber.join fibers;
+  !acc
+
+let value = Atomic.make 0
+
+let main () =
+  let me = Fiber.create (fun () ->
+      while Atomic.get value = 0 do Fiber.yield () done;
+      Atomic.get value) () in
+  Fiber.wake me;
+  Fiber.sleep 0.001;
+  let d = Domain.spawn (fun () ->
+      Fiber.run (fun () ->
+          (try Fiber.wake me with Invalid_argument s -> print_endline s);
+          Atomic.set value 42;
+          Fiber.wake_remote me) ()) in
+  let v = Fiber.join me in
+  ignore (Domain.join d);
+  v
+
+let _ =
+  let domains = List.init 4 (fun i ->
+      Domain.spawn (fun () -> Fiber.run work (i + 1))) in
+  List.iter (fun d ->
+      match Domain.join d with
+        Some v -> Printf.printf "%d\n" v
+      | None -> print_endline "break") domains;
+  match Fiber.run main () with
+    Some v -> Printf.printf "remote %d\n" v
+  | None -> print_endline "break"
@@ -0,0 +1,14 @@
+(* overflow in a C stub kills the fiber, its caller goes on *)
+let _ =
+  let f = Fiber.create ~stack_size:16384 Overflow.recurse 1_000_000 in
+  Fiber.resume f;
+  print_endline "caller continues";
+  (* same for a fiber resumed by a timer of the loop *)
+  let g = Fiber.create ~stack_size:16384 (fun () ->
+      Fiber.sleep 0.001;
+      Overflow.recurse 1_000_000) () in
+  let h = Fiber.create (fun () -> Fiber.sleep 0.005; "ok") () in
+  ignore (Fiber.run (fun () ->
+      Fiber.wake g;
+      Fiber.wake h;
+      print_endline (Fiber.join h)) ())
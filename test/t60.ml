@@ -0,0 +1,15 @@
+(* signal handlers run while fibers ping-pong in loops which never
+   allocate and so never reach a poll point of their own *)
+let fired = ref false
+
+let _ =
+  Sys.set_signal Sys.sigalrm (Sys.Signal_handle (fun _ -> fired := true));
+  let f = Fiber.create (fun () -> while true do Fiber.yield () done) () in
+  ignore (Unix.setitimer Unix.ITIMER_REAL
+            { Unix.it_interval = 0.; it_value = 0.01 });
+  let n = ref 0 in
+  while not !fired && !n < 100_000_000 do
+    Fiber.resume f;
+    incr n
+  done;
+  print_endline (if !fired then "handled" else "missed")